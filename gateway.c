@@ -18,18 +18,217 @@
 /* Configuration */
 #define SEND_INTERVAL (8 * CLOCK_SECOND)
 
+/* Size of the topology store, must be a power of two. It holds the devices
+   routed through the children table, at most MAX_CHILDREN, and the ones only
+   known from the data they send, so it follows the size of the routing table */
+#ifdef GATEWAY_CONF_TOPOLOGY_SIZE
+#define TOPOLOGY_SIZE GATEWAY_CONF_TOPOLOGY_SIZE
+#else
+#define TOPOLOGY_SIZE (2 * CHILDREN_TABLE_SIZE)
+#endif
+
+/* The store is never filled over 3/4 to keep the probe sequences short */
+#define MAX_DEVICES (TOPOLOGY_SIZE - TOPOLOGY_SIZE / 4)
+#define MAX_BARNS 16
+#define NO_BARN 0xFF
+
+/* The routed devices and the barns that lost their route always fit,
+   the devices only known from their data make room for them */
+#if MAX_DEVICES <= MAX_CHILDREN + MAX_BARNS
+#error "GATEWAY_CONF_TOPOLOGY_SIZE too small for the children table"
+#endif
+
 /*---------------------------------------------------------------------------*/
 PROCESS(gateway_process, "Gateway process");
 AUTOSTART_PROCESSES(&gateway_process);
 
 parent_t* parent;
-static linkaddr_t barns[16];
+static linkaddr_t barns[MAX_BARNS];
 static int barns_size = 0;
 
+/* Structure for the devices known to the gateway
+    - barn: index in barns of the sub-gateway it is behind, NO_BARN if unknown
+    - nexthop: neighbour of the gateway its path goes through, only the first hop
+      of the path is known, the routing keeps no more of it
+    - multicast_group: multicast group it joined with
+    - reachable: 0 once its route is gone, barns keep their entry and number
+    - last_seen: last time it joined or sent data
+    A device only known from its data is stored with reachable at 0
+*/
+typedef struct {
+  linkaddr_t addr;
+  linkaddr_t nexthop;
+  uint8_t barn;
+  uint8_t multicast_group;
+  uint8_t reachable;
+  clock_time_t last_seen;
+} device_t;
+
+/* Topology store keyed by address, open addressing with linear probing */
+static device_t devices[TOPOLOGY_SIZE];
+static uint8_t devices_used[TOPOLOGY_SIZE];
+static uint16_t devices_count = 0;
+
 // static linkaddr_t parent_addr =         {{ 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }};
 
 /*---------------------------------------------------------------------------*/
 
+static uint16_t device_hash(const linkaddr_t* addr) {
+  uint16_t hash = 0;
+  for (uint8_t i = 0; i < sizeof(linkaddr_t); i++) {
+    hash = hash * 31 + addr->u8[i];
+  }
+  return hash & (TOPOLOGY_SIZE - 1);
+}
+
+static device_t* device_find(const linkaddr_t* addr) {
+  uint16_t index = device_hash(addr);
+  for (uint16_t probes = 0; probes < TOPOLOGY_SIZE; probes++) {
+    if (!devices_used[index]) {
+      return NULL;
+    }
+    if (linkaddr_cmp(&devices[index].addr, addr)) {
+      return &devices[index];
+    }
+    index = (index + 1) & (TOPOLOGY_SIZE - 1);
+  }
+  return NULL;
+}
+
+/* Backward shift, the entries after the hole move back if their home slot allows it */
+static void device_remove(device_t* device) {
+  uint16_t hole = device - devices;
+  uint16_t index = hole;
+  while (1) {
+    index = (index + 1) & (TOPOLOGY_SIZE - 1);
+    if (!devices_used[index]) {
+      break;
+    }
+    uint16_t home = device_hash(&devices[index].addr);
+    if (((index - home) & (TOPOLOGY_SIZE - 1)) >= ((index - hole) & (TOPOLOGY_SIZE - 1))) {
+      devices[hole] = devices[index];
+      hole = index;
+    }
+  }
+  devices_used[hole] = 0;
+  devices_count--;
+}
+
+/* Device without a route heard from the longest ago, barns keep their entry */
+static device_t* device_stalest() {
+  device_t* stalest = NULL;
+  clock_time_t now = clock_time();
+  for (uint16_t i = 0; i < TOPOLOGY_SIZE; i++) {
+    device_t* device = &devices[i];
+    if (
+      !devices_used[i] || device->reachable ||
+      (device->barn != NO_BARN && linkaddr_cmp(&barns[device->barn], &device->addr))
+    ) {
+      continue;
+    }
+    if (stalest == NULL || now - device->last_seen > now - stalest->last_seen) {
+      stalest = device;
+    }
+  }
+  return stalest;
+}
+
+/* Existing entry of the address or a new one, a full store drops its stalest
+ * device only known from data. NULL if there is none */
+static device_t* device_add(const linkaddr_t* addr) {
+  device_t* device = device_find(addr);
+  if (device != NULL) {
+    return device;
+  }
+  if (devices_count >= MAX_DEVICES) {
+    device = device_stalest();
+    if (device == NULL) {
+      return NULL;
+    }
+    LOG_INFO("Topology store full, dropping ");
+    LOG_INFO_LLADDR(&device->addr);
+    LOG_INFO_("\n");
+    device_remove(device);
+  }
+  uint16_t index = device_hash(addr);
+  while (devices_used[index]) {
+    index = (index + 1) & (TOPOLOGY_SIZE - 1);
+  }
+  devices_used[index] = 1;
+  devices_count++;
+  device = &devices[index];
+  memset(device, 0, sizeof(device_t));
+  device->addr = *addr;
+  device->barn = NO_BARN;
+  return device;
+}
+
+/* Routing table changes, a direct child is a sub-gateway and gets a barn number once */
+static void child_changed(const child_t* child, uint8_t added) {
+  device_t* device = added ? device_add(&child->addr) : device_find(&child->addr);
+  if (device == NULL) {
+    if (added) {
+      LOG_WARN("Topology store full\n");
+    }
+    return;
+  }
+
+  if (!added) {
+    if (device->barn != NO_BARN && linkaddr_cmp(&barns[device->barn], &child->addr)) {
+      device->reachable = 0;
+    } else {
+      device_remove(device);
+    }
+    return;
+  }
+
+  device->nexthop = child->from;
+  device->multicast_group = child->multicast_group;
+  device->reachable = 1;
+  device->last_seen = clock_time();
+  if (!linkaddr_cmp(&child->addr, &child->from)) {
+    device_t* barn = device_find(&child->from);
+    device->barn = barn != NULL ? barn->barn : NO_BARN;
+  } else if (device->barn == NO_BARN && barns_size < MAX_BARNS) {
+    device->barn = barns_size;
+    barns[barns_size++] = child->addr;
+  }
+}
+
+/* Barn number of the origin of some data received from the neighbour via,
+ * barns_size if it is not known. An origin without a route is stored too */
+static int device_seen(const linkaddr_t* origin, const linkaddr_t* via) {
+  device_t* device = device_find(origin);
+  if (device == NULL) {
+    device = device_add(origin);
+    if (device == NULL) {
+      LOG_WARN("Topology store full\n");
+      return barns_size;
+    }
+  }
+  /* Without a route the path is only known from the data, a barn keeps its number */
+  if (!device->reachable && (device->barn == NO_BARN || !linkaddr_cmp(&barns[device->barn], origin))) {
+    device->nexthop = *via;
+    device_t* barn = device_find(via);
+    device->barn = barn != NULL ? barn->barn : NO_BARN;
+  }
+  device->last_seen = clock_time();
+  return device->barn != NO_BARN ? device->barn : barns_size;
+}
+
+/* A keep alive without payload is the probe of a node restored from its checkpoint,
+ * acked like any data but not printed */
+static uint8_t is_probe(uint8_t topic, uint16_t len_data) {
+  return topic == TOPIC_KEEP_ALIVE && len_data == 0;
+}
+
+/* Values are only turned into text here, at the serial boundary */
+void print_data(int barn_number, uint8_t topic, const uint8_t* data, uint16_t len) {
+  char text[64];
+  tlv_render(data, len, text, sizeof(text));
+  printf("/%u/%s/=%s\n", barn_number, topic_name(topic), text);
+}
+
 void input_callback(const void *data, uint16_t len,
   const linkaddr_t *src, const linkaddr_t *dest)
 {
@@ -52,26 +251,40 @@ void input_callback(const void *data, uint16_t len,
   }
 
 
+  uint8_t len_header = packet_header_len(data, len);
+  if (len_header == 0) {
+    return;
+  }
+
   uint8_t packet_type;
-  process_gateway_packet(data + 2*sizeof(linkaddr_t), len, &packet.src, &packet.dest, &packet_type, barns, &barns_size);
+  process_gateway_packet(data + len_header, len - len_header, &packet.src, &packet.dest, &packet_type);
 
   if (packet_type == DATA) {
-    data_packet_t packet_data;
-    process_data_packet(data, len, &packet_data);
-      char *stringToReturn = malloc(sizeof(char) * 20);
-      int barnNb;
-      for (barnNb = 0; barnNb < barns_size; barnNb++) {
-        if (linkaddr_cmp(&barns[barnNb], dest)) {
-          break;
-        }
+    data_packet_view_t data_view;
+    if (process_data_view(data, len, &data_view) == -1) {
+      return;
+    }
+    /* Duplicates were acked again but are printed only once */
+    if (data_view.header.topic != TOPIC_AGGREGATE) {
+      int barnNb = device_seen(&packet.src, src);
+      if (
+        !is_probe(data_view.header.topic, data_view.header.len_data) &&
+        !is_duplicate(&packet.src, data_view.header.seq, DUP_GATEWAY_LIFETIME)
+      ) {
+        print_data(barnNb, data_view.header.topic, data_view.data, data_view.header.len_data);
       }
-      sprintf(stringToReturn, "/%u/%s/=%s", barnNb, packet_data.topic, packet_data.data);
-      printf("%s\n", stringToReturn);
-      free(stringToReturn);
+      return;
+    }
 
-      /* /!\ freeing topic and data */
-      free(packet_data.topic);
-      free(packet_data.data);
+    /* Aggregate of a sub-gateway, printed as if every record came alone */
+    aggregate_record_t record;
+    uint16_t offset = 0;
+    while (aggregate_next(data_view.data, data_view.header.len_data, &offset, &record) == 0) {
+      int barnNb = device_seen(&record.origin, src);
+      if (!is_probe(record.topic, record.len_data) && !is_duplicate(&record.origin, record.seq, DUP_GATEWAY_LIFETIME)) {
+        print_data(barnNb, record.topic, record.data, record.len_data);
+      }
+    }
   } 
 }
 
@@ -82,21 +295,50 @@ void striping_data(char* message, char* barn_number, char* topic, char* data) {
   data = strtok(NULL, "/=");
 }
 
-void decide_action(char* topic, char* data, uint8_t barn_number) {
-  LOG_INFO("Topic: %s\n", topic);
+/* Turns the text of a serial command into typed values */
+void encode_command(uint8_t topic, char* data, tlv_writer_t* writer) {
+  if (topic == TOPIC_LIGHTS) {
+    /* data -> on, off or on?time_in_min */
+    char* state = strtok(data, "?");
+    char* time_in_min = strtok(NULL, "?");
+    tlv_put_bool(writer, state != NULL && strcmp(state, "on") == 0);
+    if (time_in_min != NULL) {
+      tlv_put_duration(writer, atoi(time_in_min) * 60);
+    }
+  }
+
+  if (topic == TOPIC_IRRIGATION) {
+    /* data -> time_in_sec */
+    tlv_put_duration(writer, atoi(data));
+  }
+}
+
+void decide_action(uint8_t topic, char* data, uint8_t barn_number) {
+  LOG_INFO("Topic: %s\n", topic_name(topic));
   LOG_INFO("Data: %s\n", data);
   LOG_INFO("Barn number: %d\n", barn_number);
-  if (strcmp(topic, "lights") == 0) {
-    send_data_packet(0, LIGHT_BULB_GROUP, strlen(topic), strlen(data), topic, data, &barns[barn_number], 0, NOT_MOBILE);
+
+  if (barn_number >= barns_size && !(topic == TOPIC_IRRIGATION && barn_number == 255)) {
+    LOG_WARN("Unknown barn %u\n", barn_number);
+    return;
   }
 
-  if (strcmp(topic, "irrigation") == 0) {
+  uint8_t payload[2 * (LEN_VALUE_HEADER + sizeof(uint16_t))];
+  tlv_writer_t writer;
+  tlv_init(&writer, payload, sizeof(payload));
+  encode_command(topic, data, &writer);
+
+  if (topic == TOPIC_LIGHTS) {
+    send_data_packet(0, LIGHT_BULB_GROUP, topic, writer.len, payload, &barns[barn_number], 0, NOT_MOBILE);
+  }
+
+  if (topic == TOPIC_IRRIGATION) {
     if (barn_number == 255) {
       for (int i = 0; i < barns_size; i++) {
-        send_data_packet(0, IRRIGATION_GROUP, strlen(topic), strlen(data), topic, data, &barns[i], 0, NOT_MOBILE);
+        send_data_packet(0, IRRIGATION_GROUP, topic, writer.len, payload, &barns[i], 0, NOT_MOBILE);
       }
     } else {
-      send_data_packet(0, IRRIGATION_GROUP, strlen(topic), strlen(data), topic, data, &barns[barn_number], 0, NOT_MOBILE);
+      send_data_packet(0, IRRIGATION_GROUP, topic, writer.len, payload, &barns[barn_number], 0, NOT_MOBILE);
     }
   }
 }
@@ -117,7 +359,8 @@ PROCESS_THREAD(gateway_process, ev, data)
   uart0_set_input(serial_line_input_byte);
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
+  routing_set_child_callback(child_changed);
   
   init_gateway();
 
@@ -133,9 +376,12 @@ PROCESS_THREAD(gateway_process, ev, data)
       char* topic = strtok(NULL, "/=");
       char* data = strtok(NULL, "/=");
 
-      int barn_number_int = atoi(barn_number);
+      if (barn_number != NULL && topic != NULL && data != NULL) {
+        int barn_number_int = atoi(barn_number);
 
-      decide_action(topic, data, barn_number_int);
+        /* Topic names only exist on the serial line */
+        decide_action(topic_code(topic), data, barn_number_int);
+      }
     }
 
     // if (etimer_expired(&periodic_timer)) {
@@ -31,6 +31,10 @@ static void timer_callback() {
   leds_off(LEDS_YELLOW);
 }
 
+static void give_up_callback(const linkaddr_t* dest, uint8_t topic, uint8_t seq) {
+  LOG_WARN("Gateway never acked %s (seq %u)\n", topic_name(topic), seq);
+}
+
 void input_callback(const void *data, uint16_t len,
   const linkaddr_t *src, const linkaddr_t *dest)
 {
@@ -53,33 +57,31 @@ void input_callback(const void *data, uint16_t len,
     return;
   }
 
-  uint8_t data_cpy[len];
-  memcpy(data_cpy, data, len);
+  /* Reading the command first, forwarding overwrites the packet buffer */
+  int irrigation_time = -1;
+  data_packet_view_t data_view;
+  if (process_data_view(data, len, &data_view) == 0 && data_view.header.topic == TOPIC_IRRIGATION) {
+    tlv_t value;
+    uint16_t offset = 0;
+    if (tlv_next(data_view.data, data_view.header.len_data, &offset, &value) == 0 && value.type == VALUE_DURATION) {
+      irrigation_time = tlv_to_int(&value);
+    }
+  }
 
   uint8_t packet_type;
   process_node_packet(data, len, &packet.src, &packet.dest, &packet_type, &parent, IRRIGATION_GROUP);
 
-  if (packet_type == DATA) {
-    data_packet_t data_packet;
-    process_data_packet(data_cpy, len, &data_packet);
-    if (strcmp(data_packet.topic, "irrigation") == 0) {
-      int irrigation_time = atoi(data_packet.data);
-      LOG_INFO("Irrigating for %d seconds\n", irrigation_time);
-      leds_on(LEDS_YELLOW);
-      LOG_INFO("Sending ack\n");
-      char* topic = "ack_irrigation";
-      /* data : ack?irrigation_time */
-      // size of maximum int is 11 + 1 for the '\0'
-      char* data = malloc(12 + 4);
-      sprintf(data, "time:%d", irrigation_time);
-      send_data_packet(1, UNICAST_GROUP, strlen(topic), strlen(data), topic, data, &parent.parent_addr, 1, NOT_MOBILE);
-      ctimer_set(&irrigation_timer, irrigation_time * CLOCK_SECOND, timer_callback, NULL);
-      free(data);
-    }
-    
-    /* /!\ Freeing the topic and data */
-    free(data_packet.topic);
-    free(data_packet.data);
+  if (irrigation_time >= 0) {
+    LOG_INFO("Irrigating for %d seconds\n", irrigation_time);
+    leds_on(LEDS_YELLOW);
+    LOG_INFO("Sending ack\n");
+    /* data : irrigation duration */
+    uint8_t payload[LEN_VALUE_HEADER + sizeof(uint16_t)];
+    tlv_writer_t writer;
+    tlv_init(&writer, payload, sizeof(payload));
+    tlv_put_duration(&writer, irrigation_time);
+    send_data_packet(1, UNICAST_GROUP, TOPIC_ACK_IRRIGATION, writer.len, payload, &parent.parent_addr, 1, NOT_MOBILE);
+    ctimer_set(&irrigation_timer, irrigation_time * CLOCK_SECOND, timer_callback, NULL);
   }
 }
 
@@ -95,7 +97,10 @@ PROCESS_THREAD(node_process, ev, data)
   PROCESS_BEGIN();
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
+  // Parent and children saved before a reboot, if any
+  routing_restore(&parent, NODE);
+  routing_set_give_up_callback(give_up_callback);
   etimer_set(&periodic_timer, KEEP_ALIVE_INTERVAL);
   etimer_set(&periodic_timer_setup, SEND_INTERVAL);
   init_node();
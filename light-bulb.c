@@ -52,37 +52,31 @@ void input_callback(const void *data, uint16_t len,
     return;
   }
 
-  uint8_t data_cpy[len];
-  memcpy(data_cpy, data, len);
-
-  uint8_t packet_type;
-  process_node_packet(data, len, &packet.src, &packet.dest, &packet_type, &parent, LIGHT_BULB_GROUP);
-
-  if (packet_type == DATA) {
-    data_packet_t data_packet;
-    process_data_packet(data_cpy, len, &data_packet);
-    if (strcmp(data_packet.data, "on") == 0){
-      leds_on(LEDS_RED);
-      LOG_INFO("Turning on light bulb\n");
-    } else if (strcmp(data_packet.data, "off") == 0) {
-      leds_off(LEDS_RED);
-      LOG_INFO("Turning off light bulb\n");
-    } else {
-      /* data -> on?time_in_min */
-      char *token = strtok(data_packet.data, "?");
-      if (strcmp(token, "on") == 0) {
-        token = strtok(NULL, "?");
-        int time_in_min = atoi(token);
-        LOG_INFO("Turning on light bulb for %d minutes\n", time_in_min);
+  /* Acting on the command first, forwarding overwrites the packet buffer */
+  data_packet_view_t data_view;
+  if (process_data_view(data, len, &data_view) == 0 && data_view.header.topic == TOPIC_LIGHTS) {
+    /* data -> state, and for how long when turning on */
+    tlv_t state;
+    tlv_t duration;
+    uint16_t offset = 0;
+    if (tlv_next(data_view.data, data_view.header.len_data, &offset, &state) == 0 && state.type == VALUE_BOOL) {
+      if (!tlv_to_int(&state)) {
+        leds_off(LEDS_RED);
+        LOG_INFO("Turning off light bulb\n");
+      } else if (tlv_next(data_view.data, data_view.header.len_data, &offset, &duration) == 0 && duration.type == VALUE_DURATION) {
+        uint16_t time_in_sec = tlv_to_int(&duration);
+        LOG_INFO("Turning on light bulb for %u seconds\n", time_in_sec);
         leds_on(LEDS_RED);
-        ctimer_set(&periodic_timer, time_in_min * 60 * CLOCK_SECOND, turn_off_light_bulb, NULL);
+        ctimer_set(&periodic_timer, (clock_time_t)time_in_sec * CLOCK_SECOND, turn_off_light_bulb, NULL);
+      } else {
+        leds_on(LEDS_RED);
+        LOG_INFO("Turning on light bulb\n");
       }
     }
-    
-    /* /!\ Freeing the topic and data */
-    free(data_packet.topic);
-    free(data_packet.data);
   }
+
+  uint8_t packet_type;
+  process_node_packet(data, len, &packet.src, &packet.dest, &packet_type, &parent, LIGHT_BULB_GROUP);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -100,7 +94,9 @@ PROCESS_THREAD(node_process, ev, data)
   PROCESS_BEGIN();
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
+  // Parent and children saved before a reboot, if any
+  routing_restore(&parent, NODE);
   
   static struct etimer periodic_timer_setup;
 
@@ -62,7 +62,7 @@ PROCESS_THREAD(mobile_process, ev, data)
   PROCESS_BEGIN();
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
   
   static struct etimer periodic_timer_setup;
   static int nb_queries;
@@ -70,23 +70,20 @@ PROCESS_THREAD(mobile_process, ev, data)
   while(1) {
     while (not_setup()) {
       etimer_set(&periodic_timer_setup, SEND_INTERVAL);
-      init_node();
+      init_mobile();
       PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&periodic_timer_setup));
     }
     for (nb_queries = 0; nb_queries < 3; nb_queries++){
       etimer_set(&periodic_timer_setup, SEND_INTERVAL);
-      char* topic = "mobile";
-      uint16_t len_topic = strlen(topic);
-
-      // /!\ Change the following lines to change the queried nodes 
-      char* queried_target = malloc(sizeof(char)+1);
-      *queried_target = LIGHT_SENSOR_GROUP;
-      *(queried_target+1) = '\0';
-
-      uint16_t len_data = sizeof(queried_target);
-      send_data_packet(1, UNICAST_GROUP, len_topic, len_data, topic, queried_target, &parent.parent_addr, 0, DATA_QUERY);    
+      // /!\ Change the following line to change the queried nodes 
+      uint8_t queried_target = LIGHT_SENSOR_GROUP;
+
+      uint8_t payload[LEN_VALUE_HEADER + sizeof(uint8_t)];
+      tlv_writer_t writer;
+      tlv_init(&writer, payload, sizeof(payload));
+      tlv_put_u8(&writer, queried_target);
+      send_data_packet(1, UNICAST_GROUP, TOPIC_MOBILE, writer.len, payload, &parent.parent_addr, 0, DATA_QUERY);    
       LOG_INFO("Sending query packet\n");
-      free(queried_target);
       PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&periodic_timer_setup));
       /* code */
     }
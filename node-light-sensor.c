@@ -51,45 +51,38 @@ void input_callback(const void *data, uint16_t len,
     return;
   }
 
-  uint8_t data_cpy[len];
-  memcpy(data_cpy, data, len);
+  /* Reading the query first, forwarding overwrites the packet buffer */
+  uint8_t mobile_query = 0;
+  data_packet_view_t data_view;
+  if (process_data_view(data, len, &data_view) == 0) {
+    mobile_query = data_view.header.multicast_group == LIGHT_SENSOR_GROUP && data_view.header.mobile_flags == DATA_QUERY;
+  }
 
   uint8_t packet_type;
-  process_node_packet(data_cpy, len, &packet.src, &packet.dest, &packet_type, &parent, LIGHT_SENSOR_GROUP);
+  process_node_packet(data, len, &packet.src, &packet.dest, &packet_type, &parent, LIGHT_SENSOR_GROUP);
   LOG_INFO("Received packet\n");
 
-  if (packet_type == DATA) {
-    data_packet_t data_packet;
-    process_data_packet(data_cpy, len, &data_packet);
-    if (data_packet.header.multicast_group == LIGHT_SENSOR_GROUP && data_packet.header.mobile_flags == DATA_QUERY) {
-      LOG_INFO("Received mobile query\n");
-
-      char* topic = "light";
-      uint16_t len_topic = strlen(topic);
-      char* light_intensity_str = malloc(sizeof(char) * 4);
-      sprintf(light_intensity_str, "%d", light_intensity);
-      uint16_t len_data = strlen(light_intensity_str);
-
-
-      uint64_t len_data_packet = data_packet.header.len_data + data_packet.header.len_topic + LEN_DATA_HEADER + sizeof(linkaddr_t);
-      uint8_t new_data[len_data_packet];
+  if (mobile_query) {
+    LOG_INFO("Received mobile query\n");
 
-      //modif data packet
-      build_data_header(&data_packet, 1, UNICAST_GROUP, len_topic, len_data, topic, light_intensity_str, &packet.src, DATA_RESPONSE);
+    uint8_t payload[LEN_VALUE_HEADER + sizeof(uint8_t)];
+    tlv_writer_t writer;
+    tlv_init(&writer, payload, sizeof(payload));
+    tlv_put_u8(&writer, light_intensity);
 
-      packing_data_packet(&data_packet, new_data);
-      uint8_t output[len_data_packet + LEN_HEADER];
-      packing_packet(output, &linkaddr_node_addr, &parent.parent_addr, new_data, len_data_packet);
-      forward_data_packet(output, len_data_packet + LEN_HEADER, &parent);
+    data_packet_t data_packet;
+    build_data_header(&data_packet, 1, UNICAST_GROUP, TOPIC_LIGHT, writer.len, payload, &packet.src, DATA_RESPONSE);
+    uint16_t len_data_packet = get_data_packet_len(&data_packet);
 
-      free(light_intensity_str);
+    uint8_t* output = frame_acquire();
+    if (output == NULL) {
+      return;
     }
-
-    free(data_packet.data);
-    free(data_packet.topic); 
+    uint8_t len_header = packing_header(output, &linkaddr_node_addr, &parent.parent_addr);
+    packing_data_packet(&data_packet, output + len_header);
+    forward_data_packet(output, len_data_packet + len_header, &parent);
+    frame_release(output);
   }
-
-
 }
 
 /*---------------------------------------------------------------------------*/
@@ -107,7 +100,9 @@ PROCESS_THREAD(light_sensor_process, ev, data)
   PROCESS_BEGIN();
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
+  // Parent and children saved before a reboot, if any
+  routing_restore(&parent, NODE);
   
   static struct etimer periodic_timer_setup;
 
@@ -123,18 +118,15 @@ PROCESS_THREAD(light_sensor_process, ev, data)
     etimer_reset(&periodic_timer);
     etimer_reset(&periodic_timer_setup);
     // Sending random light sensor data
-    char* topic = "light";
-    uint16_t len_topic = strlen(topic);
-
     light_intensity = generate_light_intensity();
-    // Turn the light intensity into a string
-    char* light_intensity_str = malloc(sizeof(char) * 4);
-    sprintf(light_intensity_str, "%d", light_intensity);
-    uint16_t len_data = strlen(light_intensity_str);
+    // Encoding the light intensity as a single byte
+    uint8_t payload[LEN_VALUE_HEADER + sizeof(uint8_t)];
+    tlv_writer_t writer;
+    tlv_init(&writer, payload, sizeof(payload));
+    tlv_put_u8(&writer, light_intensity);
 
-    send_data_packet(1, UNICAST_GROUP, len_topic, len_data, topic, light_intensity_str, &parent.parent_addr, 1, NOT_MOBILE);    
+    send_data_packet(1, UNICAST_GROUP, TOPIC_LIGHT, writer.len, payload, &parent.parent_addr, 1, NOT_MOBILE);    
     LOG_INFO("Packet sent\n");
-    free(light_intensity_str);
 
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&periodic_timer));
   }
@@ -66,7 +66,9 @@ PROCESS_THREAD(node_process, ev, data)
   PROCESS_BEGIN();
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
+  // Parent and children saved before a reboot, if any
+  routing_restore(&parent, NODE);
   
   static struct etimer periodic_timer_setup;
 
@@ -4,64 +4,596 @@
 #define LOG_LEVEL LOG_LEVEL_INFO
 
 /* Configuration */
-static child_t children[16];
-static uint8_t children_count = 0;
-
-static uint8_t data_counter = 0;
+static child_t children[CHILDREN_TABLE_SIZE];
+static uint8_t children_used[CHILDREN_TABLE_SIZE];
+static uint16_t children_count = 0;
+
+#if CHILDREN_TABLE_SIZE & (CHILDREN_TABLE_SIZE - 1)
+#error "CHILDREN_TABLE_SIZE must be a power of two"
+#endif
+/* Indexes, links and counts bounded by the children table, they only take
+   two bytes when the table needs them */
+#if CHILDREN_TABLE_SIZE < 0x100
+typedef uint8_t table_link_t;
+#else
+typedef uint16_t table_link_t;
+#endif
+
+/* Distinct next hops of the children, with the multicast groups using them */
+#if MAX_NEXTHOPS > MAX_CHILDREN
+#error "MAX_NEXTHOPS can not exceed MAX_CHILDREN"
+#endif
+static linkaddr_t nexthops[MAX_NEXTHOPS];
+static uint16_t nexthop_groups[MAX_NEXTHOPS];
+
+/* Per multicast group list of the next hops, with the number of children of
+   the group behind each. Every child holds a single reference, so there are
+   never more entries than children, plus the one taken while a child moves.
+   The lists are linked through the indexes plus one, 0 ends them */
+typedef struct {
+  table_link_t hop;
+  table_link_t refs;
+  table_link_t next;
+} group_hop_t;
+static group_hop_t group_hops[MAX_CHILDREN + 1];
+static table_link_t group_head[MULTICAST_GROUPS];
+
+/* Lease timer wheel, every child is in the list of the slot its lease ends in.
+   The lists are linked through the table indexes plus one, 0 ends them,
+   so a child is refreshed or removed in O(1) */
+#define LEASE_TICK (CHILD_LEASE / (CHILD_LEASE_SLOTS - 1))
+static table_link_t lease_head[CHILD_LEASE_SLOTS];
+static table_link_t lease_prev[CHILDREN_TABLE_SIZE];
+static table_link_t lease_next[CHILDREN_TABLE_SIZE];
+static uint8_t lease_slot[CHILDREN_TABLE_SIZE];
+static uint8_t lease_now = 0;
+static struct ctimer lease_timer;
+
+/* Last parent given to set_parent, none at the gateway, with how the node joined it */
+static parent_t* current_parent;
+static uint8_t parent_node_type;
+static uint8_t parent_multicast_group;
+/* Hops and rank the current parent advertised, ours follow from them */
+static uint8_t parent_hops;
+static uint16_t parent_rank = RANK_INFINITE;
+
+/* Smoothed link metrics of the neighbours heard, the least recently heard one is replaced
+    - rssi, lqi: averages of the received frames, times LINK_AVG_SCALE
+    - etx: average transmissions per acked packet, times LINK_ETX_DIVISOR
+*/
+typedef struct {
+  uint8_t used;
+  linkaddr_t addr;
+  int16_t rssi;
+  uint16_t lqi;
+  uint16_t etx;
+  uint8_t etx_samples;
+  clock_time_t heard;
+} link_entry_t;
+static link_entry_t links[LINK_NEIGHBORS];
+
+/* Trickle timer of the discovery beacons, SETUP while looking for a parent, RESPONSE after
+    - trickle_node_type: type the beacons are sent as, 0xFF until an init_* call
+    - trickle_counter: beacons heard in the current interval
+    - trickle_rest: time from the beacon to the end of the interval
+*/
+static struct ctimer trickle_timer;
+static uint8_t trickle_node_type = 0xFF;
+static clock_time_t trickle_interval;
+static uint8_t trickle_counter;
+static clock_time_t trickle_rest;
+/* RESPONSE beacon waiting for its jitter, cancelled by a better one heard meanwhile */
+static struct ctimer response_timer;
+static uint8_t response_pending = 0;
+
+/* Best parents heard in RESPONSE frames, the current one included, best first
+    - hops, rank: what the candidate advertised
+    - cost: path cost through it when it was heard, its rank plus the link to it
+*/
+typedef struct {
+  linkaddr_t addr;
+  uint8_t type;
+  signed char rssi;
+  uint8_t hops;
+  uint16_t rank;
+  uint16_t cost;
+} backup_parent_t;
+static backup_parent_t backup_parents[BACKUP_PARENTS];
+static uint8_t backup_count = 0;
+
+/* Outstanding sequence numbers of the packets sent with an ack requested
+    - pending: ring of the sequence numbers in sending order, 0 once acked
+    - head: next position in the ring
+*/
+typedef struct {
+  uint8_t used;
+  linkaddr_t dest;
+  uint8_t pending[ACK_WINDOW];
+  uint8_t head;
+  ack_stats_t stats;
+} ack_window_t;
+static ack_window_t ack_windows[ACK_WINDOWS];
+static uint8_t ack_window_victim = 0;
+/* Last sequence number given, every window takes the next one so (origin, seq) stays unique */
+static uint8_t last_seq = 0;
+
+/* Sender and time of the last DATA_ACK, one coming from the parent shows the path works */
+static linkaddr_t ack_heard_from;
+static clock_time_t ack_heard;
+
+/* Explicit keep alives, the interval grows while they are acked */
+static clock_time_t keep_alive_interval = KEEP_ALIVE_MIN;
+static clock_time_t keep_alive_sent;
+static uint8_t keep_alive_pending = 0;
+
+/* Ring of the sequenced data recently seen, the oldest entry is overwritten */
+typedef struct {
+  linkaddr_t origin;
+  uint8_t seq;
+  clock_time_t seen;
+} dup_entry_t;
+static dup_entry_t dup_cache[DUP_CACHE_SIZE];
+static uint8_t dup_cache_head = 0;
+static dup_stats_t dup_stats;
+
+/* Copies of the packets waiting for an ack, all retransmitted by a single timer
+    - tries: number of retransmissions done
+    - due: time of the next retransmission
+*/
+typedef struct {
+  uint8_t used;
+  linkaddr_t dest;
+  uint8_t seq;
+  uint8_t topic;
+  uint8_t tries;
+  clock_time_t due;
+  uint16_t len;
+  uint8_t frame[FRAME_MTU];
+} retx_entry_t;
+static retx_entry_t retx_queue[RETX_QUEUE_SIZE];
+
+/* Acks to send in a single DATA_ACK per next hop */
+typedef struct {
+  uint8_t used;
+  uint8_t node_type;
+  linkaddr_t nexthop;
+  uint8_t len;
+  uint8_t buf[ACK_BATCH_MAX];
+} ack_batch_t;
+static ack_batch_t ack_batches[ACK_BATCHES];
+static struct ctimer ack_batch_timer;
+static struct ctimer retx_timer;
+static retx_give_up_callback_t give_up_callback;
+static child_callback_t child_callback;
+
+/* Datagrams being reassembled, a slot is identified by its sender and tag
+    - used: 1 if the slot is in use
+    - received: bitmap of the fragments received
+*/
+typedef struct {
+  uint8_t used;
+  linkaddr_t src;
+  uint8_t tag;
+  uint16_t total;
+  uint32_t received;
+  clock_time_t started;
+  uint8_t buf[DATAGRAM_MTU];
+} reassembly_t;
+static reassembly_t reassembly[REASSEMBLY_BUFFERS];
+
+/* Packets too large for a pool frame are built here before being fragmented,
+   mobile packets going down before forward_data_packet copies them */
+static uint8_t datagram_buf[DATAGRAM_MTU];
+static uint8_t fragment_tag = 0;
+static nullnet_input_callback app_input_callback;
+
+/* Route changes waiting to go up to the parent in a single ROUTE_UPDATE */
+static uint8_t route_batch[ROUTE_UPDATE_MAX];
+static uint16_t route_batch_len = 0;
+static struct ctimer route_batch_timer;
+
+/* Last checkpoint in flash, a write giving the same crc is skipped */
+static struct ctimer checkpoint_timer;
+static uint8_t checkpoint_saved = 0;
+static uint16_t checkpoint_crc;
+/* Probe of a restored parent, stopped when another parent is chosen */
+static struct ctimer restore_timer;
+static clock_time_t restore_time;
+
+/* Upward records waiting to be sent in a single frame by a sub-gateway */
+static uint8_t aggregate_buf[AGGREGATE_MAX];
+static uint16_t aggregate_len = 0;
+static parent_t* aggregate_parent;
+static struct ctimer aggregate_timer;
+
+/* Frame buffers used by every send path, so RAM use is known at link time */
+static uint8_t frame_pool[FRAME_POOL_SIZE][FRAME_MTU];
+static uint8_t frame_pool_used[FRAME_POOL_SIZE];
+static frame_pool_stats_t pool_stats;
+
+/* Frames waiting for the radio, sent by tx_process in TX class order
+    - order: queuing counter, the oldest frame of a class goes first
+    - frame: pool frame owned by the queue until it is sent or dropped
+*/
+typedef struct {
+  uint8_t used;
+  uint8_t tx_class;
+  uint8_t order;
+  linkaddr_t dest;
+  uint16_t len;
+  uint8_t* frame;
+} tx_entry_t;
+static tx_entry_t tx_queue[TX_QUEUE_SIZE];
+static uint8_t tx_order = 0;
+static tx_queue_stats_t tx_stats;
+PROCESS(tx_process, "Routing TX process");
 
 
 /* CHILDREN && PARENT HANDLING */
 
 /*---------------------------------------------------------------------------*/
+static uint16_t child_hash(const linkaddr_t* addr) {
+  uint16_t hash = 0;
+  for (uint8_t i = 0; i < sizeof(linkaddr_t); i++) {
+    hash = hash * 31 + addr->u8[i];
+  }
+  return hash & (CHILDREN_TABLE_SIZE - 1);
+}
+
+/* Linear probing until the address or an empty slot is found */
+static int find_child_slot(const linkaddr_t* addr) {
+  uint16_t index = child_hash(addr);
+  for (uint16_t probes = 0; probes < CHILDREN_TABLE_SIZE; probes++) {
+    if (!children_used[index]) {
+      return -1;
+    }
+    if (linkaddr_cmp(&children[index].addr, addr)) {
+      return index;
+    }
+    index = (index + 1) & (CHILDREN_TABLE_SIZE - 1);
+  }
+  return -1;
+}
+
+static void lease_tick(void* ptr);
+/* Something changed around the node, the discovery beacons go fast again */
+static void trickle_reset();
+static void checkpoint_mark();
+
+static void lease_unlink(uint16_t index) {
+  table_link_t prev = lease_prev[index];
+  table_link_t next = lease_next[index];
+  if (prev) {
+    lease_next[prev - 1] = next;
+  } else {
+    lease_head[lease_slot[index]] = next;
+  }
+  if (next) {
+    lease_prev[next - 1] = prev;
+  }
+}
+
+/* The slot being expired is the last one the wheel comes back to */
+static void lease_link(uint16_t index) {
+  lease_slot[index] = lease_now;
+  lease_prev[index] = 0;
+  lease_next[index] = lease_head[lease_now];
+  if (lease_head[lease_now]) {
+    lease_prev[lease_head[lease_now] - 1] = index + 1;
+  }
+  lease_head[lease_now] = index + 1;
+
+  if (ctimer_expired(&lease_timer)) {
+    ctimer_set(&lease_timer, LEASE_TICK, lease_tick, NULL);
+  }
+}
+
+/* The entry of a table slot moved to another one, its neighbours follow it */
+static void lease_move(uint16_t from, uint16_t to) {
+  lease_prev[to] = lease_prev[from];
+  lease_next[to] = lease_next[from];
+  lease_slot[to] = lease_slot[from];
+  if (lease_prev[to]) {
+    lease_next[lease_prev[to] - 1] = to + 1;
+  } else {
+    lease_head[lease_slot[to]] = to + 1;
+  }
+  if (lease_next[to]) {
+    lease_prev[lease_next[to] - 1] = to + 1;
+  }
+}
+
+static void lease_refresh(uint16_t index) {
+  lease_unlink(index);
+  lease_link(index);
+}
+
+/* Backward shift deletion, keeps the probe sequences intact without tombstones */
+static void remove_child_slot(uint16_t index) {
+  uint16_t next = index;
+  lease_unlink(index);
+  children_used[index] = 0;
+  children_count--;
+
+  while (1) {
+    next = (next + 1) & (CHILDREN_TABLE_SIZE - 1);
+    if (!children_used[next]) {
+      return;
+    }
+
+    /* The entry can stay if its home slot lies cyclically in (index, next] */
+    uint16_t home = child_hash(&children[next].addr);
+    if (index <= next ? (index < home && home <= next) : (index < home || home <= next)) {
+      continue;
+    }
+
+    children[index] = children[next];
+    children_used[index] = 1;
+    children_used[next] = 0;
+    lease_move(next, index);
+    index = next;
+  }
+}
+
+static int find_nexthop(const linkaddr_t* nexthop) {
+  for (uint16_t i = 0; i < MAX_NEXTHOPS; i++) {
+    if (nexthop_groups[i] && linkaddr_cmp(&nexthops[i], nexthop)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* Link to the entry of the next hop in the group list, 0 if it has none */
+static table_link_t find_group_hop(uint8_t multicast_group, uint16_t hop) {
+  table_link_t link = group_head[multicast_group];
+  while (link && group_hops[link - 1].hop != hop) {
+    link = group_hops[link - 1].next;
+  }
+  return link;
+}
+
+/* Takes a reference on the next hop for the group, returns -1 if there is no room for it */
+static int add_group_nexthop(uint8_t multicast_group, const linkaddr_t* nexthop) {
+  int index = find_nexthop(nexthop);
+  if (index == -1) {
+    for (uint16_t i = 0; i < MAX_NEXTHOPS; i++) {
+      if (!nexthop_groups[i]) {
+        index = i;
+        nexthops[i] = *nexthop;
+        break;
+      }
+    }
+    if (index == -1) {
+      return -1;
+    }
+  }
+
+  if (nexthop_groups[index] & (1 << multicast_group)) {
+    group_hops[find_group_hop(multicast_group, index) - 1].refs++;
+    return index;
+  }
+
+  /* Never full, there is an entry per child plus one */
+  uint16_t entry = 0;
+  while (group_hops[entry].refs) {
+    entry++;
+  }
+  group_hops[entry].hop = index;
+  group_hops[entry].refs = 1;
+  group_hops[entry].next = group_head[multicast_group];
+  group_head[multicast_group] = entry + 1;
+  nexthop_groups[index] |= 1 << multicast_group;
+  return index;
+}
+
+/* Drops a reference, the next hop leaves the group with the last child of the group behind it */
+static void release_group_nexthop(uint8_t multicast_group, const linkaddr_t* nexthop) {
+  int index = find_nexthop(nexthop);
+  if (index == -1 || !(nexthop_groups[index] & (1 << multicast_group))) {
+    return;
+  }
+
+  table_link_t* link = &group_head[multicast_group];
+  while (group_hops[*link - 1].hop != index) {
+    link = &group_hops[*link - 1].next;
+  }
+  group_hop_t* entry = &group_hops[*link - 1];
+  entry->refs--;
+  if (entry->refs == 0) {
+    *link = entry->next;
+    nexthop_groups[index] &= ~(1 << multicast_group);
+  }
+}
+
+/* Removes a child and its next hop from the multicast groups, without telling anyone */
+static void child_remove(uint16_t index) {
+  child_t old_child = children[index];
+  remove_child_slot(index);
+  release_group_nexthop(old_child.multicast_group, &old_child.from);
+  checkpoint_mark();
+  if (child_callback != NULL) {
+    child_callback(&old_child, 0);
+  }
+}
+
+/* Traffic of a child, the next hop relaying it is alive too */
+static void child_refresh(const linkaddr_t* addr) {
+  int index = find_child_slot(addr);
+  if (index == -1) {
+    return;
+  }
+  lease_refresh(index);
+  if (!linkaddr_cmp(&children[index].from, addr)) {
+    int hop = find_child_slot(&children[index].from);
+    if (hop != -1) {
+      lease_refresh(hop);
+    }
+  }
+}
+
+static void route_update_flush(void* ptr) {
+  ctimer_stop(&route_batch_timer);
+  if (route_batch_len > 0 && current_parent != NULL) {
+    control_packet_send(parent_node_type, &current_parent->parent_addr, ROUTE_UPDATE, route_batch_len, route_batch);
+  }
+  route_batch_len = 0;
+}
+
+/* Appends a change to the ROUTE_UPDATE, sending it first if it is full, the gateway has no one to tell */
+static void route_update_add(uint8_t op, uint8_t multicast_group, const linkaddr_t* addr) {
+  if (current_parent == NULL) {
+    return;
+  }
+  if (route_batch_len + 1 + LEN_ADDR > ROUTE_UPDATE_MAX) {
+    route_update_flush(NULL);
+  }
+  route_batch[route_batch_len] = op << 7 | (multicast_group & 0xF);
+  route_batch_len += 1 + packing_addr(route_batch + route_batch_len + 1, addr);
+
+  if (ROUTE_UPDATE_WINDOW == 0) {
+    route_update_flush(NULL);
+  } else if (ctimer_expired(&route_batch_timer)) {
+    ctimer_set(&route_batch_timer, ROUTE_UPDATE_WINDOW, route_update_flush, NULL);
+  }
+}
+
+/* Expires the children of the slot the wheel turned to, reported up with the other route changes */
+static void lease_tick(void* ptr) {
+  ctimer_reset(&lease_timer);
+  lease_now = (lease_now + 1) % CHILD_LEASE_SLOTS;
+  while (lease_head[lease_now]) {
+    uint16_t index = lease_head[lease_now] - 1;
+    LOG_INFO("Lease expired for child: ");
+    LOG_INFO_LLADDR(&children[index].addr);
+    LOG_INFO_("\n");
+    route_update_add(ROUTE_REMOVE, 0, &children[index].addr);
+    child_remove(index);
+  }
+}
+
+/* Control packet carrying a single address, CHILD_RM and DATA_ACK */
+static void control_addr_send(uint8_t node_type, linkaddr_t* dest, uint8_t response_type, const linkaddr_t* addr) {
+  uint8_t data[LEN_ADDR];
+  control_packet_send(node_type, dest, response_type, packing_addr(data, addr), data);
+}
+
 void set_parent(const linkaddr_t* parent_addr, uint8_t type, signed char rssi, parent_t* parent, uint8_t node_type, uint8_t multicast_group) {
+  uint8_t moved = current_parent == NULL || !linkaddr_cmp(&parent->parent_addr, parent_addr);
+  if (moved) {
+    /* Changes meant for the previous parent, the new one learns the whole table below */
+    ctimer_stop(&route_batch_timer);
+    route_batch_len = 0;
+  }
   linkaddr_copy(&parent->parent_addr, parent_addr);
   type_parent = type;
   parent->type = type;
   parent->rssi = rssi;
 
+  /* A new parent is probed at the shortest interval again */
+  keep_alive_interval = KEEP_ALIVE_MIN;
+  keep_alive_pending = 0;
+  current_parent = parent;
+  parent_node_type = node_type;
+  parent_multicast_group = multicast_group;
+  trickle_reset();
+  ctimer_stop(&restore_timer);
+  checkpoint_mark();
+
   // Sending setup ack to the parent
-  uint8_t data[sizeof(linkaddr_t) + 1];
+  uint8_t data[LEN_ADDR + 1];
   data[0] = multicast_group;
-  memcpy(data + 1, &linkaddr_node_addr, sizeof(linkaddr_t));
-  control_packet_send(node_type, &parent->parent_addr, SETUP_ACK, sizeof(linkaddr_t) + 1, data);
+  uint8_t len_addr = packing_addr(data + 1, &linkaddr_node_addr);
+  control_packet_send(node_type, &parent->parent_addr, SETUP_ACK, len_addr + 1, data);
+
+  /* The subtree moves with us, announced in a few ROUTE_UPDATE frames */
+  if (moved) {
+    for (uint16_t i = 0; i < CHILDREN_TABLE_SIZE; i++) {
+      if (children_used[i]) {
+        route_update_add(ROUTE_ADD, children[i].multicast_group, &children[i].addr);
+      }
+    }
+  }
 }
 
-void set_child(const linkaddr_t* src, uint8_t* data) {
+/* Adds or moves a child reached through src, the old next hop is told to drop it */
+static int child_add(const linkaddr_t* src, const linkaddr_t* addr, uint8_t multicast_group) {
   child_t new_child;
-  new_child.addr = ((linkaddr_t*) (data + 2))[0];
+  new_child.addr = *addr;
   new_child.from = *src;
-  new_child.multicast_group = data[1];
+  new_child.multicast_group = multicast_group & 0xF;
 
   linkaddr_t old_nexthop;
   int old_index = get_children(&new_child.addr, &old_nexthop);
 
   if (old_index != -1) {
+    child_t old_child = children[old_index];
+    if (add_group_nexthop(new_child.multicast_group, src) == -1) {
+      LOG_WARN("Next hops table full, dropping child\n");
+      return -1;
+    }
     /* Update if nexthop is different or nexthop is not the addr itself */
     if (!linkaddr_cmp(&old_nexthop, src) && !linkaddr_cmp(&old_nexthop, &new_child.addr)) {
-      control_packet_send(0, &old_nexthop, CHILD_RM, sizeof(linkaddr_t), &new_child.addr);
+      control_addr_send(0, &old_nexthop, CHILD_RM, &new_child.addr);
     }
     children[old_index] = new_child;
+    lease_refresh(old_index);
+    release_group_nexthop(old_child.multicast_group, &old_child.from);
     LOG_INFO("Updating child\n");
-    return;
+    if (!linkaddr_cmp(&old_child.from, src) || old_child.multicast_group != new_child.multicast_group) {
+      checkpoint_mark();
+      if (child_callback != NULL) {
+        child_callback(&new_child, 1);
+      }
+    }
+    return old_index;
+  }
+
+  if (children_count >= MAX_CHILDREN) {
+    LOG_WARN("Children table full, dropping child\n");
+    return -1;
+  }
+
+  if (add_group_nexthop(new_child.multicast_group, src) == -1) {
+    LOG_WARN("Next hops table full, dropping child\n");
+    return -1;
   }
 
-  children[children_count] = new_child;
+  uint16_t index = child_hash(&new_child.addr);
+  while (children_used[index]) {
+    index = (index + 1) & (CHILDREN_TABLE_SIZE - 1);
+  }
+  children[index] = new_child;
+  children_used[index] = 1;
   children_count++;
+  lease_link(index);
+  checkpoint_mark();
+  if (child_callback != NULL) {
+    child_callback(&new_child, 1);
+  }
+  return index;
+}
+
+int set_child(const linkaddr_t* src, const uint8_t* data, uint16_t len) {
+  linkaddr_t addr;
+  if (len < 2 || process_addr(data + 2, len - 2, &addr) == 0) {
+    LOG_WARN("Malformed setup ack\n");
+    return -1;
+  }
+  return child_add(src, &addr, data[1]);
 }
 
 int get_children(const linkaddr_t* src, linkaddr_t* nexthop) {
-  for (uint8_t i = 0; i < children_count; i++) {
-    if (linkaddr_cmp(&children[i].addr, src)) {
-      *nexthop = children[i].from;
-      return i;
-    }
+  int index = find_child_slot(src);
+  if (index != -1) {
+    *nexthop = children[index].from;
   }
-  return -1;
+  return index;
 }
 
 int get_multicast_children(uint8_t multicast_group, linkaddr_t* nexthop, int start_index) {
-  for (int i = start_index; i < children_count; i++) {
-    if (children[i].multicast_group == multicast_group) {
+  for (int i = start_index; i < CHILDREN_TABLE_SIZE; i++) {
+    if (children_used[i] && children[i].multicast_group == multicast_group) {
       *nexthop = children[i].from;
       return i;
     }
@@ -69,22 +601,20 @@ int get_multicast_children(uint8_t multicast_group, linkaddr_t* nexthop, int sta
   return -1;
 }
 
-void send_child(child_t child, uint8_t node_type, parent_t* parent) {
-  uint8_t data[sizeof(linkaddr_t) + 1];
-  data[0] = child.multicast_group;
-  memcpy(data + 1, &child.addr, sizeof(linkaddr_t));
-  control_packet_send(node_type, &parent->parent_addr, SETUP_ACK, sizeof(linkaddr_t) + 1, data);
+void send_child(child_t child) {
+  route_update_add(ROUTE_ADD, child.multicast_group, &child.addr);
 }
 
 void rm_child(linkaddr_t* addr) {
-  linkaddr_t nexthop;
-  int index = get_children(addr, &nexthop);
-  if (index != -1) {
-    children[index] = children[children_count - 1];
-    children_count--;
+  int index = find_child_slot(addr);
+  if (index == -1) {
+    return;
   }
+
+  linkaddr_t nexthop = children[index].from;
+  child_remove(index);
   if (!linkaddr_cmp(&nexthop, addr)) {
-    control_packet_send(0, &nexthop, CHILD_RM, sizeof(linkaddr_t), addr);
+    control_addr_send(0, &nexthop, CHILD_RM, addr);
   }
 }
 /*---------------------------------------------------------------------------*/
@@ -98,391 +628,1905 @@ uint8_t not_setup() {
   return setup == 0;
 }
 
+static void trickle_interval_end(void* ptr);
+static uint16_t own_rank();
+static int process_rank(const uint8_t* data, uint16_t len, uint8_t* hops, uint16_t* rank);
+
+/* Only sub-gateways join the gateway, the beacons of the others serve the same nodes,
+ * the cheapest path to the gateway is the one they should hear */
+static uint8_t response_outranks(uint8_t node_type, uint16_t rank) {
+  return
+    node_type != PHONE && node_type != GATEWAY &&
+    trickle_node_type != GATEWAY && rank < own_rank();
+}
+
+static void response_send(void* ptr) {
+  if (!response_pending) {
+    return;
+  }
+  response_pending = 0;
+  if (trickle_counter >= TRICKLE_K) {
+    LOG_INFO("Beacon suppressed, %u heard\n", trickle_counter);
+    return;
+  }
+  uint16_t rank = own_rank();
+  if (rank == RANK_INFINITE) {
+    return;
+  }
+  uint8_t data[3];
+  data[0] = trickle_node_type == GATEWAY ? 0 : parent_hops + 1;
+  data[1] = rank >> 8;
+  data[2] = rank & 0xFF;
+  control_packet_send(trickle_node_type, NULL, RESPONSE, sizeof(data), data);
+}
+
+/* Middle of the interval, the beacon is sent unless enough of them were heard */
+static void trickle_fire(void* ptr) {
+  if (trickle_node_type != GATEWAY && not_setup()) {
+    /* Looking for a parent, never suppressed */
+    control_packet_send(trickle_node_type, NULL, SETUP, 0, NULL);
+  } else if (trickle_node_type == PHONE) {
+    /* A mobile node is nobody's parent */
+  } else if (trickle_counter < TRICKLE_K) {
+    /* Neighbours reset by the same SETUP fire close together, the jitter spreads them */
+    response_pending = 1;
+    ctimer_set(&response_timer, RESPONSE_JITTER ? random_rand() % RESPONSE_JITTER : 0, response_send, NULL);
+  } else {
+    LOG_INFO("Beacon suppressed, %u heard\n", trickle_counter);
+  }
+  ctimer_set(&trickle_timer, trickle_rest, trickle_interval_end, NULL);
+}
+
+/* The beacon goes at a random time of the second half of the interval */
+static void trickle_interval_start() {
+  trickle_counter = 0;
+  clock_time_t t = trickle_interval / 2 + random_rand() % (trickle_interval / 2);
+  trickle_rest = trickle_interval - t;
+  ctimer_set(&trickle_timer, t, trickle_fire, NULL);
+}
+
+/* Nothing changed in the interval, the next one is twice as long.
+ * A node without a parent keeps sending SETUP at least every TRICKLE_SETUP_IMAX */
+static void trickle_interval_end(void* ptr) {
+  clock_time_t imax = trickle_node_type != GATEWAY && not_setup() ? TRICKLE_SETUP_IMAX : TRICKLE_IMAX;
+  trickle_interval = trickle_interval * 2 < imax ? trickle_interval * 2 : imax;
+  trickle_interval_start();
+}
+
+static void trickle_start(uint8_t node_type) {
+  if (trickle_node_type != 0xFF) {
+    return;
+  }
+  trickle_node_type = node_type;
+  trickle_interval = TRICKLE_IMIN;
+  trickle_interval_start();
+}
+
+static void trickle_reset() {
+  if (trickle_node_type == 0xFF || trickle_interval == TRICKLE_IMIN) {
+    return;
+  }
+  trickle_interval = TRICKLE_IMIN;
+  trickle_interval_start();
+}
+
+/* Counts the RESPONSE beacons of the nodes of the same type, which stand for ours,
+ * a better ranked one makes the pending beacon useless */
+static void trickle_input(const uint8_t* data, uint16_t len) {
+  uint8_t len_header = packet_header_len(data, len);
+  if (trickle_node_type == 0xFF || len_header == 0 || len <= len_header) {
+    return;
+  }
+  uint8_t head = data[len_header];
+  if (head >> 7 != CONTROL || ((head >> 2) & 0b111) != RESPONSE) {
+    return;
+  }
+  uint8_t node_type = (head >> 5) & 0b11;
+  if (node_type == trickle_node_type && trickle_counter < 0xFF) {
+    trickle_counter++;
+  }
+  uint8_t hops;
+  uint16_t rank;
+  if (
+    response_pending && process_rank(data + len_header, len - len_header, &hops, &rank) == 0 &&
+    response_outranks(node_type, rank)
+  ) {
+    LOG_INFO("Beacon cancelled, better ranked one heard\n");
+    response_pending = 0;
+    ctimer_stop(&response_timer);
+  }
+}
+
 void init_node() {
-  control_packet_send(NODE, NULL, SETUP, 0, NULL);
+  trickle_start(NODE);
 }
 
 void init_sub_gateway() {
-  control_packet_send(SUB_GATEWAY, NULL, SETUP, 0, NULL);
+  trickle_start(SUB_GATEWAY);
 }
 
 void init_gateway() {
-  control_packet_send(GATEWAY, NULL, SETUP, 0, NULL);
+  trickle_start(GATEWAY);
+}
+
+void init_mobile() {
+  trickle_start(PHONE);
 }
 /*---------------------------------------------------------------------------*/
 
 
-/* PACKET HANDLING */
+/* FRAME POOL */
 
 
 /*---------------------------------------------------------------------------*/
-void packing_packet(uint8_t* output, linkaddr_t* src, linkaddr_t* dest, uint8_t* packet, uint16_t len_packet) {
-  /* Adding the src and dest at the beginning of the packet */
-  memcpy(output, src, sizeof(linkaddr_t));
-  memcpy(output + sizeof(linkaddr_t), dest, sizeof(linkaddr_t));
+uint8_t* frame_acquire() {
+  for (uint8_t i = 0; i < FRAME_POOL_SIZE; i++) {
+    if (!frame_pool_used[i]) {
+      frame_pool_used[i] = 1;
+      pool_stats.in_use++;
+      if (pool_stats.in_use > pool_stats.high_water) {
+        pool_stats.high_water = pool_stats.in_use;
+      }
+      return frame_pool[i];
+    }
+  }
+  pool_stats.failures++;
+  LOG_WARN("Frame pool empty\n");
+  return NULL;
+}
 
-  /* Adding the packet */
-  memcpy(output + LEN_HEADER, packet, len_packet);
+static uint8_t frame_in_pool(const uint8_t* frame) {
+  for (uint8_t i = 0; i < FRAME_POOL_SIZE; i++) {
+    if (frame == frame_pool[i]) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
-void process_packet(const uint8_t* input_data, uint16_t len, packet_t* packet) {
-  if (len == 0) {
-    return;
+/* Buffers not from the pool are ignored */
+void frame_release(uint8_t* frame) {
+  for (uint8_t i = 0; i < FRAME_POOL_SIZE; i++) {
+    if (frame == frame_pool[i] && frame_pool_used[i]) {
+      frame_pool_used[i] = 0;
+      pool_stats.in_use--;
+      return;
+    }
   }
+}
 
-  /* Extracting the source and destination addresses */
-  memcpy(&packet->src, input_data, sizeof(linkaddr_t));
-  memcpy(&packet->dest, input_data + sizeof(linkaddr_t), sizeof(linkaddr_t));
+void frame_pool_stats(frame_pool_stats_t* stats) {
+  *stats = pool_stats;
 }
+
 /*---------------------------------------------------------------------------*/
 
 
-/* DATA PACKET HANDLING */
+/* TRANSMIT QUEUE */
 
 
 /*---------------------------------------------------------------------------*/
-void build_data_header(data_packet_t* data_packet, uint8_t up, uint8_t multicast_group, uint16_t len_topic, uint16_t len_data, char* topic, char* data, linkaddr_t* dest, uint8_t mobile_flags) {
-  data_header_t header;
-  header.type = DATA;
-  header.up = up;
-  header.multicast_group = multicast_group;
-  header.len_topic = len_topic;
-  header.len_data = len_data;
-  header.dest = *dest;
-  header.mobile_flags = mobile_flags;
-
-  data_packet->header = header;
-  data_packet->topic = topic;
-  data_packet->data = data;
+static uint8_t topic_tx_class(uint8_t topic) {
+  if (topic == TOPIC_KEEP_ALIVE) {
+    return TX_KEEP_ALIVE;
+  }
+  if (topic == TOPIC_LIGHTS || topic == TOPIC_IRRIGATION) {
+    return TX_COMMAND;
+  }
+  return TX_TELEMETRY;
 }
 
-void packing_data_packet(data_packet_t* data_packet, uint8_t* data) {
-  data[0] = 0;
-  data[0] = data_packet->header.type << 7;
-  data[0] |= data_packet->header.up << 6;
-  data[0] |= data_packet->header.multicast_group << 2;
-  data[0] |= data_packet->header.mobile_flags;
-
-  /* Setting the first 2 bytes to be the length of topic wihtout erasing the first bit */
-  memcpy(data + 1, &data_packet->header.len_topic, sizeof(uint16_t));
-  memcpy(data + 3, &data_packet->header.len_data, sizeof(uint16_t));
-
-  uint8_t offset = 0;
-  if (data_packet->header.up == 0) {
-    /* If going down we need to specify the dest addr */
-    memcpy(data + LEN_DATA_HEADER, &data_packet->header.dest, sizeof(linkaddr_t));
-    offset = sizeof(linkaddr_t);
+/* Oldest frame of the highest class to send, or newest of the lowest class to evict */
+static tx_entry_t* tx_pick(uint8_t lowest) {
+  tx_entry_t* best = NULL;
+  for (uint8_t i = 0; i < TX_QUEUE_SIZE; i++) {
+    tx_entry_t* entry = &tx_queue[i];
+    if (!entry->used) {
+      continue;
+    }
+    if (best == NULL ||
+      (lowest ? entry->tx_class > best->tx_class : entry->tx_class < best->tx_class) ||
+      (entry->tx_class == best->tx_class && (lowest ? (int8_t)(entry->order - best->order) > 0 : (int8_t)(entry->order - best->order) < 0))) {
+      best = entry;
+    }
   }
+  return best;
+}
 
-  /* Setting the rest of the data to be the data_packet->topic and data_packet->data pointers */
-  memcpy(data + offset + LEN_DATA_HEADER, data_packet->topic, data_packet->header.len_topic);
-  memcpy(data + offset + LEN_DATA_HEADER + data_packet->header.len_topic, data_packet->data, data_packet->header.len_data);
+static void tx_free(tx_entry_t* entry) {
+  entry->used = 0;
+  tx_stats.depth[entry->tx_class]--;
+  frame_release(entry->frame);
 }
 
-void process_data_packet(const uint8_t *input_data, uint16_t len, data_packet_t* data_packet) {
-  if (len == 0) {
+/* Queues a frame of the pool, the queue owns it from then on and gives it back
+ * once it is sent or dropped, a NULL dest is a broadcast as for NETSTACK_NETWORK.output */
+static void frame_send(uint8_t* frame, uint16_t len, const linkaddr_t* dest, uint8_t tx_class) {
+  if (len > FRAME_MTU) {
+    frame_release(frame);
     return;
   }
 
-  data_header_t header;
-
-  /* Extracting the first byte of the data */
-  header.type = input_data[LEN_HEADER] >> 7;
-  header.up = (input_data[LEN_HEADER] >> 6) & 0x1;
-  header.multicast_group = (input_data[LEN_HEADER] >> 2) & 0xF;
-  header.mobile_flags = input_data[LEN_HEADER] & 0x3;
+  tx_entry_t* entry = NULL;
+  for (uint8_t i = 0; i < TX_QUEUE_SIZE; i++) {
+    if (!tx_queue[i].used) {
+      entry = &tx_queue[i];
+      break;
+    }
+  }
 
-  /* Extracting the first 2 bytes of the data */
-  memcpy(&header.len_topic, input_data + LEN_HEADER + 1, sizeof(uint16_t));
-  memcpy(&header.len_data, input_data + LEN_HEADER + 3, sizeof(uint16_t));
+  /* Full, a frame of a lower class makes room or this one is dropped */
+  if (entry == NULL) {
+    entry = tx_pick(1);
+    if (entry->tx_class <= tx_class) {
+      tx_stats.drops[tx_class]++;
+      LOG_WARN("TX queue full, dropping a class %u frame\n", tx_class);
+      frame_release(frame);
+      return;
+    }
+    tx_stats.drops[entry->tx_class]++;
+    LOG_WARN("TX queue full, evicting a class %u frame\n", entry->tx_class);
+    tx_free(entry);
+  }
 
-  uint8_t offset = 0;
-  if (header.up == 0) {
-    header.dest = *((linkaddr_t*)(input_data + LEN_HEADER + LEN_DATA_HEADER));
-    offset = sizeof(linkaddr_t);
+  entry->used = 1;
+  entry->tx_class = tx_class;
+  entry->order = tx_order++;
+  linkaddr_copy(&entry->dest, dest == NULL ? &linkaddr_null : dest);
+  entry->len = len;
+  entry->frame = frame;
+  tx_stats.depth[tx_class]++;
+  if (tx_stats.depth[tx_class] > tx_stats.high_water[tx_class]) {
+    tx_stats.high_water[tx_class] = tx_stats.depth[tx_class];
   }
 
-  /* Extracting the topic and data */
-  char* data_topic = malloc(sizeof(char) * (header.len_topic + 1));
-  char* data = malloc(sizeof(char) * (header.len_data + 1));
+  if (!process_is_running(&tx_process)) {
+    process_start(&tx_process, NULL);
+  }
+  process_poll(&tx_process);
+}
 
-  memcpy(data_topic, input_data + LEN_HEADER + LEN_DATA_HEADER + offset, header.len_topic);
-  memcpy(data, input_data + LEN_HEADER + LEN_DATA_HEADER + offset + header.len_topic, header.len_data);
+/* Queues a copy of a buffer that is not a pool frame, the caller keeps it */
+static void frame_send_copy(const uint8_t* buf, uint16_t len, const linkaddr_t* dest, uint8_t tx_class) {
+  if (len > FRAME_MTU) {
+    return;
+  }
+  uint8_t* frame = frame_acquire();
+  if (frame == NULL) {
+    tx_stats.drops[tx_class]++;
+    return;
+  }
+  memcpy(frame, buf, len);
+  frame_send(frame, len, dest, tx_class);
+}
 
-  data_topic[header.len_topic] = '\0';
-  data[header.len_data] = '\0';
+void tx_queue_stats(tx_queue_stats_t* stats) {
+  *stats = tx_stats;
+}
 
-  data_packet->header = header;
-  data_packet->topic = data_topic;
-  data_packet->data = data;
+/* Drains the queue one frame at a time, so the receive callbacks run in between */
+PROCESS_THREAD(tx_process, ev, data)
+{
+  static tx_entry_t* entry;
+
+  PROCESS_BEGIN();
+
+  while(1) {
+    PROCESS_WAIT_EVENT_UNTIL(ev == PROCESS_EVENT_POLL);
+    while ((entry = tx_pick(0)) != NULL) {
+      /* nullnet copies the frame to the packet buffer, the entry and its frame are free right after */
+      nullnet_buf = entry->frame;
+      nullnet_len = entry->len;
+      NETSTACK_NETWORK.output(&entry->dest);
+      tx_stats.sent[entry->tx_class]++;
+      tx_free(entry);
+      PROCESS_PAUSE();
+    }
+  }
 
+  PROCESS_END();
 }
 /*---------------------------------------------------------------------------*/
 
 
-/* DATA PACKET SENDING */
+/* PACKET HANDLING */
 
 
 /*---------------------------------------------------------------------------*/
-void send_data_packet(uint8_t up, uint8_t multicast_group, uint16_t len_topic, uint16_t len_data, char* topic, char* input_data, linkaddr_t* dest, uint8_t ack, uint8_t mobile_flags) {
-  /* Setting the nexthop */
-  linkaddr_t nexthop = *dest;
-  
-  data_packet_t data_packet;
-  build_data_header(&data_packet, up, multicast_group, len_topic, len_data, topic, input_data, dest, mobile_flags);
-
-  uint8_t offset = 0;
-  if (up == 0) {
-    offset = sizeof(linkaddr_t);
+uint8_t packing_addr(uint8_t* output, const linkaddr_t* addr) {
+#if COMPRESS_HEADER
+  /* Short form when only the first two bytes are used, like the Cooja node ids */
+  uint8_t is_short = addr->u8[1] < ADDR_SHORT;
+  for (uint8_t i = 2; i < sizeof(linkaddr_t); i++) {
+    is_short &= addr->u8[i] == 0;
   }
+  if (is_short) {
+    output[0] = ADDR_SHORT | addr->u8[1];
+    output[1] = addr->u8[0];
+    return 2;
+  }
+  output[0] = ADDR_FULL;
+  memcpy(output + 1, addr, sizeof(linkaddr_t));
+  return sizeof(linkaddr_t) + 1;
+#else
+  memcpy(output, addr, sizeof(linkaddr_t));
+  return sizeof(linkaddr_t);
+#endif
+}
 
-  print_data_packet(&data_packet);
+uint8_t process_addr(const uint8_t* input_data, uint16_t len, linkaddr_t* addr) {
+#if COMPRESS_HEADER
+  if (len == 0) {
+    return 0;
+  }
+  if (input_data[0] & ADDR_SHORT) {
+    if (len < 2) {
+      return 0;
+    }
+    memset(addr, 0, sizeof(linkaddr_t));
+    addr->u8[1] = input_data[0] & ~ADDR_SHORT;
+    addr->u8[0] = input_data[1];
+    return 2;
+  }
+  if (input_data[0] == ADDR_ELIDED) {
+    /* Only valid while the received frame is in the packet buffer */
+    linkaddr_copy(addr, packetbuf_addr(PACKETBUF_ADDR_SENDER));
+    return 1;
+  }
+  if (input_data[0] != ADDR_FULL || len < sizeof(linkaddr_t) + 1) {
+    return 0;
+  }
+  memcpy(addr, input_data + 1, sizeof(linkaddr_t));
+  return sizeof(linkaddr_t) + 1;
+#else
+  if (len < sizeof(linkaddr_t)) {
+    return 0;
+  }
+  memcpy(addr, input_data, sizeof(linkaddr_t));
+  return sizeof(linkaddr_t);
+#endif
+}
 
-  uint64_t len_data_packet = len_data + len_topic + offset + LEN_DATA_HEADER;
-  uint8_t data[len_data_packet];
-  packing_data_packet(&data_packet, data);
+uint8_t packing_header(uint8_t* output, const linkaddr_t* src, const linkaddr_t* dest) {
+#if COMPRESS_HEADER
+  /* The dest is the MAC destination, given to nullnet when sending */
+  return packing_addr(output, src);
+#else
+  memcpy(output, src, sizeof(linkaddr_t));
+  memcpy(output + sizeof(linkaddr_t), dest, sizeof(linkaddr_t));
+  return LEN_HEADER;
+#endif
+}
 
-  uint8_t output[len_data_packet + LEN_HEADER];
-  packing_packet(output, &linkaddr_node_addr, &nexthop, data, len_data_packet);
+/* Header of the packets sent by this node to a neighbour and never forwarded */
+static uint8_t packing_link_header(uint8_t* output, const linkaddr_t* dest) {
+#if COMPRESS_HEADER
+  output[0] = ADDR_ELIDED;
+  return 1;
+#else
+  return packing_header(output, &linkaddr_node_addr, dest);
+#endif
+}
 
-  nullnet_buf = output;
-  nullnet_len = len_data_packet + LEN_HEADER;
+/* Forwarding changes the dest of the header, the compressed one has none */
+static void patching_header_dest(uint8_t* output, const linkaddr_t* dest) {
+#if !COMPRESS_HEADER
+  memcpy(output + sizeof(linkaddr_t), dest, sizeof(linkaddr_t));
+#endif
+}
 
-  LOG_INFO("Sending data packet to: ");
-  LOG_INFO_LLADDR(&nexthop);
-  LOG_INFO_("\n");
-  NETSTACK_NETWORK.output(&nexthop);
+/* Unicast of a packet of any size up to DATAGRAM_MTU */
+static void datagram_send(uint8_t* datagram, uint16_t len, const linkaddr_t* dest, uint8_t tx_class);
 
-  if (!ack) {
-    return;
-  }
+uint16_t packing_packet(uint8_t* output, linkaddr_t* src, linkaddr_t* dest, uint8_t* packet, uint16_t len_packet) {
+  /* Adding the src and dest at the beginning of the packet */
+  uint8_t len_header = packing_header(output, src, dest);
 
-  data_counter++;
+  /* Adding the packet */
+  memcpy(output + len_header, packet, len_packet);
+  return len_header + len_packet;
+}
+
+uint8_t packet_header_len(const uint8_t* input_data, uint16_t len) {
+  linkaddr_t src;
+  uint8_t len_src = process_addr(input_data, len, &src);
+#if COMPRESS_HEADER
+  return len_src;
+#else
+  if (len_src == 0 || len < LEN_HEADER) {
+    return 0;
+  }
+  return LEN_HEADER;
+#endif
+}
+
+void process_packet(const uint8_t* input_data, uint16_t len, packet_t* packet) {
+  /* Extracting the source and destination addresses */
+  uint8_t len_src = process_addr(input_data, len, &packet->src);
+  if (len_src == 0) {
+    return;
+  }
+
+#if COMPRESS_HEADER
+  linkaddr_copy(&packet->dest, packetbuf_addr(PACKETBUF_ADDR_RECEIVER));
+#else
+  process_addr(input_data + len_src, len - len_src, &packet->dest);
+#endif
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* FRAGMENTATION */
+
+
+/*---------------------------------------------------------------------------*/
+/* Sends a datagram as fragments, the dest of its header is patched on the way */
+static void fragment_send(const uint8_t* datagram, uint16_t len, const linkaddr_t* dest, uint8_t tx_class) {
+  control_header_t header;
+  control_packet_t control_packet;
+  build_control_header(&header, NODE, FRAGMENT, NULL);
+  control_packet.header = &header;
+  control_packet.data = NULL;
+  uint8_t tag = fragment_tag++;
+
+  LOG_INFO("Sending %u bytes in fragments to: ", len);
+  LOG_INFO_LLADDR(dest);
+  LOG_INFO_("\n");
+
+  for (uint16_t offset = 0; offset < len; offset += FRAGMENT_PAYLOAD) {
+    uint16_t len_fragment = len - offset < FRAGMENT_PAYLOAD ? len - offset : FRAGMENT_PAYLOAD;
+    uint8_t* output = frame_acquire();
+    if (output == NULL) {
+      return;
+    }
+
+    uint8_t len_header = packing_link_header(output, dest);
+    packing_control_packet(&control_packet, output + len_header, 0);
+    uint8_t* fragment = output + len_header + LEN_CONTROL_HEADER;
+    fragment[0] = tag;
+    memcpy(fragment + 1, &offset, sizeof(uint16_t));
+    memcpy(fragment + 3, &len, sizeof(uint16_t));
+    memcpy(fragment + LEN_FRAGMENT_HEADER, datagram + offset, len_fragment);
+    if (offset == 0) {
+      patching_header_dest(fragment + LEN_FRAGMENT_HEADER, dest);
+    }
+
+    frame_send(output, len_header + LEN_CONTROL_HEADER + LEN_FRAGMENT_HEADER + len_fragment, dest, tx_class);
+  }
+}
+
+/* A datagram that fits a frame is handed to the queue, a copy of it if it is
+ * not a pool frame, a larger one is fragmented out of the caller's buffer */
+static void datagram_send(uint8_t* datagram, uint16_t len, const linkaddr_t* dest, uint8_t tx_class) {
+  if (len > FRAME_MTU) {
+    fragment_send(datagram, len, dest, tx_class);
+    return;
+  }
+  if (!frame_in_pool(datagram)) {
+    frame_send_copy(datagram, len, dest, tx_class);
+    return;
+  }
+  frame_send(datagram, len, dest, tx_class);
+}
+
+/* Slot of the datagram, a new one if it is the first fragment, stale slots are reused */
+static reassembly_t* reassembly_slot(const linkaddr_t* src, uint8_t tag, uint16_t total) {
+  reassembly_t* free_slot = NULL;
+  for (uint8_t i = 0; i < REASSEMBLY_BUFFERS; i++) {
+    reassembly_t* slot = &reassembly[i];
+    if (slot->used && clock_time() - slot->started > REASSEMBLY_TIMEOUT) {
+      LOG_WARN("Reassembly timed out, dropping %u bytes\n", slot->total);
+      slot->used = 0;
+    }
+    if (slot->used && slot->tag == tag && linkaddr_cmp(&slot->src, src)) {
+      return slot->total == total ? slot : NULL;
+    }
+    if (!slot->used && free_slot == NULL) {
+      free_slot = slot;
+    }
+  }
+
+  if (free_slot == NULL) {
+    LOG_WARN("No reassembly buffer left, dropping fragment\n");
+    return NULL;
+  }
+  free_slot->used = 1;
+  free_slot->src = *src;
+  free_slot->tag = tag;
+  free_slot->total = total;
+  free_slot->received = 0;
+  free_slot->started = clock_time();
+  return free_slot;
+}
+
+/* Stores a fragment, returns the slot once the datagram is complete */
+static reassembly_t* reassembly_add(const linkaddr_t* src, const uint8_t* fragment, uint16_t len) {
+  uint16_t offset;
+  uint16_t total;
+  if (len < LEN_FRAGMENT_HEADER) {
+    return NULL;
+  }
+  memcpy(&offset, fragment + 1, sizeof(uint16_t));
+  memcpy(&total, fragment + 3, sizeof(uint16_t));
+  uint16_t len_fragment = len - LEN_FRAGMENT_HEADER;
+
+  if (
+    total > DATAGRAM_MTU || offset % FRAGMENT_PAYLOAD != 0 ||
+    (uint32_t)offset + len_fragment > total ||
+    len_fragment != (total - offset < FRAGMENT_PAYLOAD ? total - offset : FRAGMENT_PAYLOAD)
+  ) {
+    LOG_WARN("Malformed fragment\n");
+    return NULL;
+  }
+
+  reassembly_t* slot = reassembly_slot(src, fragment[0], total);
+  if (slot == NULL) {
+    return NULL;
+  }
+  memcpy(slot->buf + offset, fragment + LEN_FRAGMENT_HEADER, len_fragment);
+  slot->received |= (uint32_t)1 << (offset / FRAGMENT_PAYLOAD);
+
+  uint8_t count = (total + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD;
+  uint32_t all = count >= 32 ? 0xFFFFFFFF : ((uint32_t)1 << count) - 1;
+  return slot->received == all ? slot : NULL;
+}
+
+/* Reassembles the fragments, every other packet goes straight to the application */
+static void link_rx_sample(const linkaddr_t* addr, signed char rssi, uint8_t lqi);
+static void trickle_input(const uint8_t* data, uint16_t len);
+
+/* Any packet of a child renews its lease, every node of an aggregate too */
+static void lease_input(const uint8_t* data, uint16_t len) {
+  linkaddr_t src;
+  if (children_count == 0 || process_addr(data, len, &src) == 0) {
+    return;
+  }
+  child_refresh(&src);
+
+  data_packet_view_t view;
+  if (process_data_view(data, len, &view) == -1 || view.header.up == 0 || view.header.topic != TOPIC_AGGREGATE) {
+    return;
+  }
+  aggregate_record_t record;
+  uint16_t offset = 0;
+  while (aggregate_next(view.data, view.header.len_data, &offset, &record) == 0) {
+    child_refresh(&record.origin);
+  }
+}
+
+static void routing_input(const void* data, uint16_t len, const linkaddr_t* src, const linkaddr_t* dest) {
+  link_rx_sample(src, cc2420_last_rssi, cc2420_last_correlation);
+  trickle_input(data, len);
+
+  uint8_t len_header = packet_header_len(data, len);
+  const uint8_t* head = (const uint8_t*)data + len_header;
+  if (len_header == 0 || len <= len_header || head[0] >> 7 != CONTROL || ((head[0] >> 2) & 0b111) != FRAGMENT) {
+    lease_input(data, len);
+    app_input_callback(data, len, src, dest);
+    return;
+  }
+
+  packet_t packet;
+  process_packet(data, len, &packet);
+  if (!linkaddr_cmp(&packet.dest, &linkaddr_node_addr)) {
+    return;
+  }
+
+  reassembly_t* slot = reassembly_add(&packet.src, head + LEN_CONTROL_HEADER, len - len_header - LEN_CONTROL_HEADER);
+  if (slot == NULL) {
+    return;
+  }
+  LOG_INFO("Reassembled %u bytes\n", slot->total);
+  lease_input(slot->buf, slot->total);
+  app_input_callback(slot->buf, slot->total, src, dest);
+  slot->used = 0;
+}
+
+void routing_set_input_callback(nullnet_input_callback callback) {
+  app_input_callback = callback;
+  nullnet_set_input_callback(routing_input);
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* DATA PACKET HANDLING */
+
+
+/*---------------------------------------------------------------------------*/
+void build_data_header(data_packet_t* data_packet, uint8_t up, uint8_t multicast_group, uint8_t topic, uint16_t len_data, uint8_t* data, linkaddr_t* dest, uint8_t mobile_flags) {
+  data_header_t header;
+  header.type = DATA;
+  header.up = up;
+  header.multicast_group = multicast_group;
+  header.topic = topic;
+  header.seq = 0;
+  header.len_data = len_data;
+  header.dest = *dest;
+  header.mobile_flags = mobile_flags;
+
+  data_packet->header = header;
+  data_packet->data = data;
+}
+
+uint16_t get_data_packet_len(data_packet_t* data_packet) {
+  uint16_t len = LEN_DATA_HEADER + data_packet->header.len_data;
+  if (data_packet->header.up == 0) {
+    uint8_t dest[LEN_ADDR];
+    len += packing_addr(dest, &data_packet->header.dest);
+  }
+  return len;
+}
+
+void packing_data_packet(data_packet_t* data_packet, uint8_t* data) {
+  data[0] = 0;
+  data[0] = data_packet->header.type << 7;
+  data[0] |= data_packet->header.up << 6;
+  data[0] |= data_packet->header.multicast_group << 2;
+  data[0] |= data_packet->header.mobile_flags;
+
+  /* Setting the topic code, the sequence number and the 2 bytes of the length of data */
+  data[1] = data_packet->header.topic;
+  data[2] = data_packet->header.seq;
+  memcpy(data + 3, &data_packet->header.len_data, sizeof(uint16_t));
+
+  uint8_t offset = 0;
+  if (data_packet->header.up == 0) {
+    /* If going down we need to specify the dest addr */
+    offset = packing_addr(data + LEN_DATA_HEADER, &data_packet->header.dest);
+  }
+
+  /* Setting the rest of the data to be the data_packet->data pointer */
+  memcpy(data + offset + LEN_DATA_HEADER, data_packet->data, data_packet->header.len_data);
+}
+
+int process_data_view(const uint8_t* input_data, uint16_t len, data_packet_view_t* view) {
+  uint8_t len_header = packet_header_len(input_data, len);
+  if (len_header == 0 || len < len_header + LEN_DATA_HEADER) {
+    return -1;
+  }
+
+  const uint8_t* head = input_data + len_header;
+  data_header_t* header = &view->header;
+
+  /* Extracting the first byte of the data */
+  header->type = head[0] >> 7;
+  if (header->type != DATA) {
+    return -1;
+  }
+  header->up = (head[0] >> 6) & 0x1;
+  header->multicast_group = (head[0] >> 2) & 0xF;
+  header->mobile_flags = head[0] & 0x3;
+
+  header->topic = head[1];
+  header->seq = head[2];
+  memcpy(&header->len_data, head + 3, sizeof(uint16_t));
+
+  uint16_t offset = len_header + LEN_DATA_HEADER;
+  if (header->up == 0) {
+    uint8_t len_dest = process_addr(input_data + offset, len - offset, &header->dest);
+    if (len_dest == 0) {
+      return -1;
+    }
+    offset += len_dest;
+  } else {
+    header->dest = null_addr;
+  }
+
+  /* Data is a slice of the frame, checking it fits in it */
+  if ((uint32_t)offset + header->len_data > len) {
+    return -1;
+  }
+  view->data = input_data + offset;
+  return 0;
+}
+
+/* Data packet pointing to the slice of the view, only to be packed */
+static void data_packet_from_view(const data_packet_view_t* view, data_packet_t* data_packet) {
+  data_packet->header = view->header;
+  data_packet->data = (uint8_t*)view->data;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* ACK TRACKING */
+
+
+/*---------------------------------------------------------------------------*/
+/* Stops retransmitting a packet, the application is told if it is given up */
+static uint8_t retx_remove(const linkaddr_t* dest, uint8_t seq, uint8_t give_up);
+
+/* One packet to a neighbour took this many transmissions, LINK_ETX_LOSS if never acked */
+static void link_etx_sample(const linkaddr_t* addr, uint8_t transmissions);
+
+/* Window of a destination, the oldest one is reused when they are all taken */
+static ack_window_t* ack_window(const linkaddr_t* dest, uint8_t create) {
+  for (uint8_t i = 0; i < ACK_WINDOWS; i++) {
+    if (ack_windows[i].used && linkaddr_cmp(&ack_windows[i].dest, dest)) {
+      return &ack_windows[i];
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+
+  ack_window_t* window = NULL;
+  for (uint8_t i = 0; i < ACK_WINDOWS && window == NULL; i++) {
+    if (!ack_windows[i].used) {
+      window = &ack_windows[i];
+    }
+  }
+  if (window == NULL) {
+    window = &ack_windows[ack_window_victim];
+    ack_window_victim = (ack_window_victim + 1) % ACK_WINDOWS;
+  }
+  memset(window, 0, sizeof(ack_window_t));
+  window->used = 1;
+  window->dest = *dest;
+  return window;
+}
+
+/* Registers a sent packet, returns its sequence number */
+static uint8_t ack_window_send(ack_window_t* window) {
+  /* 0 is kept for the packets without ack */
+  uint8_t seq = last_seq == 0xFF ? 1 : last_seq + 1;
+  last_seq = seq;
+
+  if (window->pending[window->head] != 0) {
+    retx_remove(&window->dest, window->pending[window->head], 1);
+    link_etx_sample(&window->dest, LINK_ETX_LOSS);
+    window->stats.lost++;
+    window->stats.outstanding--;
+  }
+  window->pending[window->head] = seq;
+  window->head = (window->head + 1) % ACK_WINDOW;
+  window->stats.sent++;
+  window->stats.outstanding++;
+  return seq;
+}
+
+/* Number of consecutive packets without ack sent before the last one */
+static uint8_t ack_window_unacked(ack_window_t* window) {
+  uint8_t count = 0;
+  uint8_t index = (window->head + ACK_WINDOW - 1) % ACK_WINDOW;
+  for (uint8_t i = 1; i < ACK_WINDOW; i++) {
+    index = (index + ACK_WINDOW - 1) % ACK_WINDOW;
+    if (window->pending[index] == 0) {
+      break;
+    }
+    count++;
+  }
+  return count;
+}
+
+/* Counts the packets sent before the last one as lost, to start again after a rejoin */
+static void ack_window_drop(ack_window_t* window) {
+  uint8_t last = (window->head + ACK_WINDOW - 1) % ACK_WINDOW;
+  for (uint8_t i = 0; i < ACK_WINDOW; i++) {
+    if (i != last && window->pending[i] != 0) {
+      retx_remove(&window->dest, window->pending[i], 1);
+      link_etx_sample(&window->dest, LINK_ETX_LOSS);
+      window->pending[i] = 0;
+      window->stats.lost++;
+      window->stats.outstanding--;
+    }
+  }
+}
+
+/* Clears an acked sequence number in the window of the neighbour the ack came from,
+ * late acks inside the window still count */
+static void ack_window_ack(const linkaddr_t* src, uint8_t seq) {
+  ack_window_t* window = ack_window(src, 0);
+  if (window != NULL) {
+    for (uint8_t j = 0; j < ACK_WINDOW; j++) {
+      if (window->pending[j] == seq) {
+        link_etx_sample(&window->dest, retx_remove(&window->dest, seq, 0) + 1);
+        window->pending[j] = 0;
+        window->stats.acked++;
+        window->stats.outstanding--;
+        return;
+      }
+    }
+  }
+  LOG_INFO("Ack of seq %u too late or unknown\n", seq);
+}
+
+int ack_window_stats(const linkaddr_t* dest, ack_stats_t* stats) {
+  ack_window_t* window = ack_window(dest, 0);
+  if (window == NULL) {
+    return -1;
+  }
+  *stats = window->stats;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* DUPLICATES */
+
+
+/*---------------------------------------------------------------------------*/
+uint8_t is_duplicate(const linkaddr_t* origin, uint8_t seq, clock_time_t lifetime) {
+  if (seq == 0) {
+    return 0;
+  }
+
+  clock_time_t now = clock_time();
+  for (uint8_t i = 0; i < DUP_CACHE_SIZE; i++) {
+    dup_entry_t* entry = &dup_cache[i];
+    if (entry->seq == seq && linkaddr_cmp(&entry->origin, origin) && now - entry->seen < lifetime) {
+      dup_stats.hits++;
+      return 1;
+    }
+  }
+
+  dup_stats.misses++;
+  dup_cache[dup_cache_head].origin = *origin;
+  dup_cache[dup_cache_head].seq = seq;
+  dup_cache[dup_cache_head].seen = now;
+  dup_cache_head = (dup_cache_head + 1) % DUP_CACHE_SIZE;
+  return 0;
+}
+
+void dup_cache_stats(dup_stats_t* stats) {
+  *stats = dup_stats;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* RETRANSMISSION */
+
+
+/*---------------------------------------------------------------------------*/
+static clock_time_t retx_backoff(uint8_t tries) {
+  clock_time_t interval = (clock_time_t)RETX_INTERVAL << tries;
+  return interval + random_rand() % (interval / 2 + 1);
+}
+
+static void retx_timeout(void* ptr);
+
+/* Sets the timer to the earliest retransmission */
+static void retx_schedule() {
+  clock_time_t now = clock_time();
+  retx_entry_t* next = NULL;
+  for (uint8_t i = 0; i < RETX_QUEUE_SIZE; i++) {
+    if (retx_queue[i].used && (next == NULL || (long)(retx_queue[i].due - next->due) < 0)) {
+      next = &retx_queue[i];
+    }
+  }
+
+  if (next == NULL) {
+    ctimer_stop(&retx_timer);
+    return;
+  }
+  ctimer_set(&retx_timer, (long)(next->due - now) > 0 ? next->due - now : 0, retx_timeout, NULL);
+}
+
+static void retx_timeout(void* ptr) {
+  clock_time_t now = clock_time();
+  for (uint8_t i = 0; i < RETX_QUEUE_SIZE; i++) {
+    retx_entry_t* entry = &retx_queue[i];
+    if (!entry->used || (long)(now - entry->due) < 0) {
+      continue;
+    }
+
+    if (entry->tries >= RETX_MAX_TRIES) {
+      LOG_WARN("Giving up on seq %u\n", entry->seq);
+      entry->used = 0;
+      if (give_up_callback != NULL) {
+        give_up_callback(&entry->dest, entry->topic, entry->seq);
+      }
+      continue;
+    }
+
+    LOG_INFO("Retransmitting seq %u, try %u\n", entry->seq, entry->tries + 1);
+    frame_send_copy(entry->frame, entry->len, &entry->dest, topic_tx_class(entry->topic));
+    entry->tries++;
+    entry->due = now + retx_backoff(entry->tries);
+
+    ack_window_t* window = ack_window(&entry->dest, 0);
+    if (window != NULL) {
+      window->stats.retransmissions++;
+    }
+  }
+  retx_schedule();
+}
+
+/* Keeps a copy of a sent frame until it is acked */
+static void retx_add(const linkaddr_t* dest, uint8_t seq, uint8_t topic, const uint8_t* frame, uint16_t len) {
+  if (len > FRAME_MTU) {
+    LOG_WARN("Fragmented packets are not retransmitted\n");
+    return;
+  }
+
+  retx_entry_t* entry = NULL;
+  for (uint8_t i = 0; i < RETX_QUEUE_SIZE && entry == NULL; i++) {
+    if (!retx_queue[i].used) {
+      entry = &retx_queue[i];
+    }
+  }
+  if (entry == NULL) {
+    LOG_WARN("Retransmission queue full, seq %u sent once\n", seq);
+    return;
+  }
+
+  entry->used = 1;
+  entry->dest = *dest;
+  entry->seq = seq;
+  entry->topic = topic;
+  entry->tries = 0;
+  entry->due = clock_time() + retx_backoff(0);
+  entry->len = len;
+  memcpy(entry->frame, frame, len);
+  retx_schedule();
+}
+
+/* Returns the number of retransmissions done, 0 if the packet was not queued */
+static uint8_t retx_remove(const linkaddr_t* dest, uint8_t seq, uint8_t give_up) {
+  for (uint8_t i = 0; i < RETX_QUEUE_SIZE; i++) {
+    retx_entry_t* entry = &retx_queue[i];
+    if (entry->used && entry->seq == seq && linkaddr_cmp(&entry->dest, dest)) {
+      entry->used = 0;
+      if (give_up && give_up_callback != NULL) {
+        give_up_callback(&entry->dest, entry->topic, entry->seq);
+      }
+      retx_schedule();
+      return entry->tries;
+    }
+  }
+  return 0;
+}
+
+void routing_set_give_up_callback(retx_give_up_callback_t callback) {
+  give_up_callback = callback;
+}
+
+void routing_set_child_callback(child_callback_t callback) {
+  child_callback = callback;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* DATA PACKET SENDING */
+
+
+/*---------------------------------------------------------------------------*/
+/* Switches to the best backup parent once the current one stops acking */
+static int parent_failover(parent_t* parent);
+
+void send_data_packet(uint8_t up, uint8_t multicast_group, uint8_t topic, uint16_t len_data, uint8_t* input_data, linkaddr_t* dest, uint8_t ack, uint8_t mobile_flags) {
+  /* Setting the nexthop */
+  linkaddr_t nexthop = *dest;
+  
+  data_packet_t data_packet;
+  build_data_header(&data_packet, up, multicast_group, topic, len_data, input_data, dest, mobile_flags);
+
+  ack_window_t* window = NULL;
+  if (ack) {
+    window = ack_window(&nexthop, 1);
+    data_packet.header.seq = ack_window_send(window);
+  }
+
+  print_data_packet(&data_packet);
+
+  uint32_t len_data_packet = get_data_packet_len(&data_packet);
+  if (len_data_packet + LEN_HEADER > DATAGRAM_MTU) {
+    LOG_WARN("Data packet too large: %lu bytes\n", (unsigned long)len_data_packet);
+    return;
+  }
+
+  /* Packets larger than a frame are built whole, then sent in fragments,
+   * the header is packed first as a compressed one can make the packet fit */
+  uint8_t header[LEN_HEADER];
+  uint8_t len_header = packing_header(header, &linkaddr_node_addr, &nexthop);
+  uint8_t* output = len_data_packet + len_header > FRAME_MTU ? datagram_buf : frame_acquire();
+  if (output == NULL) {
+    return;
+  }
+  memcpy(output, header, len_header);
+  packing_data_packet(&data_packet, output + len_header);
 
-  if (data_counter >= UNACK_TRESH) {
+  LOG_INFO("Sending data packet to: ");
+  LOG_INFO_LLADDR(&nexthop);
+  LOG_INFO_("\n");
+  /* retx_add keeps its own copy, taken before the queue owns the frame */
+  if (ack) {
+    retx_add(&nexthop, data_packet.header.seq, topic, output, len_data_packet + len_header);
+  }
+  datagram_send(output, len_data_packet + len_header, &nexthop, topic_tx_class(topic));
+
+  if (!ack) {
+    return;
+  }
+
+  /* A single late or lost ack is not enough to leave the parent */
+  if (ack_window_unacked(window) >= UNACK_TRESH) {
     LOG_INFO("Connection to parent lost \n");
-    setup = 0;
-    data_counter = 0;
+    ack_window_drop(window);
+    if (
+      current_parent == NULL ||
+      !linkaddr_cmp(&current_parent->parent_addr, &nexthop) ||
+      parent_failover(current_parent) == -1
+    ) {
+      setup = 0;
+      trickle_reset();
+    }
   }
 }
 
 void forward_data_packet(const void *data, uint16_t len, parent_t* parent) {
-  data_packet_t data_packet;
-  process_data_packet(data, len, &data_packet);
+  /* Only validating the header, the frame is forwarded as is */
+  data_packet_view_t data_view;
+  if (process_data_view(data, len, &data_view) == -1) {
+    LOG_INFO("Ignoring malformed data packet\n");
+    return;
+  }
+
+  if (len > DATAGRAM_MTU) {
+    LOG_WARN("Data packet too large to forward: %u bytes\n", len);
+    return;
+  }
+
+  /* Copies received twice in a row are not sent again, retransmissions are */
+  linkaddr_t origin;
+  process_addr(data, len, &origin);
+  if (data_view.header.up == 1 && is_duplicate(&origin, data_view.header.seq, DUP_FORWARD_LIFETIME)) {
+    LOG_INFO("Dropping duplicate seq %u\n", data_view.header.seq);
+    return;
+  }
+
+  uint8_t tx_class = topic_tx_class(data_view.header.topic);
+
+  /* Reassembled datagram, fragmented again for the next hops */
+  if (len > FRAME_MTU) {
+    if (data_view.header.up == 1) {
+      fragment_send(data, len, &parent->parent_addr, tx_class);
+      return;
+    }
+    table_link_t link = group_head[data_view.header.multicast_group];
+    for (; link; link = group_hops[link - 1].next) {
+      fragment_send(data, len, &nexthops[group_hops[link - 1].hop], tx_class);
+    }
+    return;
+  }
 
-  uint8_t output[len]; 
-  memcpy(output, data, sizeof(linkaddr_t));
-  packing_data_packet(&data_packet, output + LEN_HEADER);
-  free(data_packet.topic);
-  free(data_packet.data);
+  /* Copied out of the packet buffer into a pool frame the queue keeps,
+   * every next hop but the last gets its own copy with the dest bytes patched */
+  uint8_t* output = frame_acquire();
+  if (output == NULL) {
+    return;
+  }
+  memcpy(output, data, len);
 
-  if (data_packet.header.up == 1) {
+  if (data_view.header.up == 1) {
     /* Changing the dest value to the address of the parent */
-    memcpy(output + sizeof(linkaddr_t), &parent->parent_addr, sizeof(linkaddr_t));
-    nullnet_buf = output;
-    nullnet_len = len;
+    patching_header_dest(output, &parent->parent_addr);
+
+    const linkaddr_t dest = parent->parent_addr;
+    LOG_INFO("Forwarding data packet to: ");
+    LOG_INFO_LLADDR(&dest);
+    LOG_INFO_("\n");
+    frame_send(output, len, &dest, tx_class);
+    return;
+  }
+
+  /* Forwarding to all the next hops of the multicast group */
+  table_link_t link = group_head[data_view.header.multicast_group];
+  if (!link) {
+    frame_release(output);
+    return;
+  }
+  for (; link; link = group_hops[link - 1].next) {
+    const linkaddr_t nexthop = nexthops[group_hops[link - 1].hop];
+    uint8_t* frame = output;
+    if (group_hops[link - 1].next) {
+      frame = frame_acquire();
+      if (frame == NULL) {
+        continue;
+      }
+      memcpy(frame, output, len);
+    }
+
+    /* Changing the dest value */
+    patching_header_dest(frame, &nexthop);
+
+    LOG_INFO("Forwarding data packet to: ");
+    LOG_INFO_LLADDR(&nexthop);
+    LOG_INFO_("\n");
+    frame_send(frame, len, &nexthop, tx_class);
+  }
+}
+
+uint8_t keep_alive(parent_t* parent, char* name) {
+  clock_time_t now = clock_time();
+  uint8_t heard = linkaddr_cmp(&ack_heard_from, &parent->parent_addr);
+
+  /* Outcome of the previous keep alive, acked or not in a whole call period */
+  if (keep_alive_pending) {
+    keep_alive_pending = 0;
+    if (heard && (long)(ack_heard - keep_alive_sent) >= 0) {
+      keep_alive_interval = keep_alive_interval * 2 < KEEP_ALIVE_MAX ? keep_alive_interval * 2 : KEEP_ALIVE_MAX;
+    } else {
+      keep_alive_interval = KEEP_ALIVE_MIN;
+    }
+  }
+
+  /* The applications timers drift, a quarter period of slack avoids skipping a whole one */
+  if (heard && now - ack_heard + KEEP_ALIVE_MIN / 4 < keep_alive_interval) {
+    LOG_INFO("Keep alive implicit, parent heard %lu s ago\n", (unsigned long)((now - ack_heard) / CLOCK_SECOND));
+    return 0;
+  }
+
+  LOG_INFO("Sending keep alive packet, next one in %lu s at most\n", (unsigned long)(keep_alive_interval / CLOCK_SECOND));
+  uint8_t payload[LEN_VALUE_HEADER + 16];
+  tlv_writer_t writer;
+  tlv_init(&writer, payload, sizeof(payload));
+  tlv_put_string(&writer, name);
+  send_data_packet(1, UNICAST_GROUP, TOPIC_KEEP_ALIVE, writer.len, payload, &parent->parent_addr, 1, NOT_MOBILE);
+  keep_alive_sent = now;
+  keep_alive_pending = 1;
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* AGGREGATION */
+
+
+/*---------------------------------------------------------------------------*/
+static void aggregate_timeout(void* ptr) {
+  aggregate_flush();
+}
+
+/* The caller checked the record fits in what is left of aggregate_buf */
+static void aggregate_append(const linkaddr_t* origin, uint8_t topic, uint8_t seq, const uint8_t* data, uint8_t len_data) {
+  uint8_t* output = aggregate_buf + aggregate_len;
+  uint8_t len_origin = packing_addr(output, origin);
+  output[len_origin] = topic;
+  output[len_origin + 1] = seq;
+  output[len_origin + 2] = len_data;
+  memcpy(output + len_origin + LEN_RECORD_HEADER, data, len_data);
+
+  if (aggregate_len == 0) {
+    ctimer_set(&aggregate_timer, AGGREGATE_WINDOW, aggregate_timeout, NULL);
+  }
+  aggregate_len += len_origin + LEN_RECORD_HEADER + len_data;
+}
+
+int aggregate_data_packet(const data_packet_view_t* view, const linkaddr_t* origin, parent_t* parent) {
+  uint8_t origin_buf[LEN_ADDR];
+  uint16_t len_record = packing_addr(origin_buf, origin) + LEN_RECORD_HEADER + view->header.len_data;
+  if (AGGREGATE_WINDOW == 0 || view->header.len_data > 0xFF || len_record > AGGREGATE_MAX) {
+    return -1;
+  }
+
+  /* Full, sends are only queued so the data the view points into stays valid,
+   * without a frame for the aggregate the packet goes on alone. The duplicate
+   * check comes after, forward_data_packet makes its own */
+  if (aggregate_len + len_record > AGGREGATE_MAX && aggregate_flush() == -1) {
+    return -1;
+  }
+  if (is_duplicate(origin, view->header.seq, DUP_FORWARD_LIFETIME)) {
+    LOG_INFO("Dropping duplicate seq %u\n", view->header.seq);
+    return 0;
+  }
+  aggregate_parent = parent;
+  aggregate_append(origin, view->header.topic, view->header.seq, view->data, view->header.len_data);
+  return 0;
+}
+
+int aggregate_flush() {
+  if (aggregate_len == 0) {
+    return 0;
+  }
+  ctimer_stop(&aggregate_timer);
+
+  data_packet_t data_packet;
+  build_data_header(&data_packet, 1, UNICAST_GROUP, TOPIC_AGGREGATE, aggregate_len, aggregate_buf, &aggregate_parent->parent_addr, NOT_MOBILE);
+  uint16_t len_data_packet = get_data_packet_len(&data_packet);
+
+  uint8_t* output = frame_acquire();
+  if (output == NULL) {
+    /* Trying again later, the records are kept */
+    ctimer_set(&aggregate_timer, AGGREGATE_WINDOW, aggregate_timeout, NULL);
+    return -1;
+  }
+  uint8_t len_header = packing_header(output, &linkaddr_node_addr, &aggregate_parent->parent_addr);
+  packing_data_packet(&data_packet, output + len_header);
+
+  LOG_INFO("Sending aggregate of %u bytes to: ", aggregate_len);
+  LOG_INFO_LLADDR(&aggregate_parent->parent_addr);
+  LOG_INFO_("\n");
+  frame_send(output, len_header + len_data_packet, &aggregate_parent->parent_addr, TX_TELEMETRY);
+  aggregate_len = 0;
+  return 0;
+}
+
+int aggregate_next(const uint8_t* payload, uint16_t len, uint16_t* offset, aggregate_record_t* record) {
+  if (*offset >= len) {
+    return -1;
+  }
+  uint8_t len_origin = process_addr(payload + *offset, len - *offset, &record->origin);
+  uint32_t start = (uint32_t)*offset + len_origin + LEN_RECORD_HEADER;
+  if (len_origin == 0 || start > len) {
+    return -1;
+  }
+  record->topic = payload[start - 3];
+  record->seq = payload[start - 2];
+  record->len_data = payload[start - 1];
+  if (start + record->len_data > len) {
+    return -1;
+  }
+  record->data = payload + start;
+  *offset = start + record->len_data;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* TOPICS */
+
+
+/*---------------------------------------------------------------------------*/
+static const char* const topic_names[] = {
+  [TOPIC_UNKNOWN] = "unknown",
+  [TOPIC_KEEP_ALIVE] = "keep_alive",
+  [TOPIC_LIGHT] = "light",
+  [TOPIC_LIGHTS] = "lights",
+  [TOPIC_IRRIGATION] = "irrigation",
+  [TOPIC_ACK_IRRIGATION] = "ack_irrigation",
+  [TOPIC_MOBILE] = "mobile",
+  [TOPIC_AGGREGATE] = "aggregate",
+};
+#define TOPIC_COUNT (sizeof(topic_names) / sizeof(topic_names[0]))
+
+const char* topic_name(uint8_t topic) {
+  if (topic >= TOPIC_COUNT) {
+    return topic_names[TOPIC_UNKNOWN];
+  }
+  return topic_names[topic];
+}
+
+uint8_t topic_code(const char* name) {
+  for (uint8_t i = 1; i < TOPIC_COUNT; i++) {
+    if (strcmp(topic_names[i], name) == 0) {
+      return i;
+    }
+  }
+  return TOPIC_UNKNOWN;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* TYPED VALUES */
+
+
+/*---------------------------------------------------------------------------*/
+void tlv_init(tlv_writer_t* writer, uint8_t* buf, uint16_t size) {
+  writer->buf = buf;
+  writer->size = size;
+  writer->len = 0;
+}
+
+static int tlv_put(tlv_writer_t* writer, uint8_t type, uint8_t len, uint16_t value) {
+  if (writer->len + LEN_VALUE_HEADER + len > writer->size) {
+    return -1;
+  }
+  uint8_t* out = writer->buf + writer->len;
+  out[0] = type;
+  out[1] = len;
+  if (len == 2) {
+    out[2] = value >> 8;
+    out[3] = value & 0xFF;
+  } else {
+    out[2] = value;
+  }
+  writer->len += LEN_VALUE_HEADER + len;
+  return 0;
+}
+
+int tlv_put_u8(tlv_writer_t* writer, uint8_t value) {
+  return tlv_put(writer, VALUE_U8, 1, value);
+}
+
+int tlv_put_u16(tlv_writer_t* writer, uint16_t value) {
+  return tlv_put(writer, VALUE_U16, 2, value);
+}
+
+int tlv_put_i16(tlv_writer_t* writer, int16_t value) {
+  return tlv_put(writer, VALUE_I16, 2, (uint16_t)value);
+}
+
+int tlv_put_fixed(tlv_writer_t* writer, int16_t value) {
+  return tlv_put(writer, VALUE_FIXED, 2, (uint16_t)value);
+}
+
+int tlv_put_bool(tlv_writer_t* writer, uint8_t value) {
+  return tlv_put(writer, VALUE_BOOL, 1, value != 0);
+}
+
+int tlv_put_duration(tlv_writer_t* writer, uint16_t seconds) {
+  return tlv_put(writer, VALUE_DURATION, 2, seconds);
+}
+
+int tlv_put_string(tlv_writer_t* writer, const char* value) {
+  size_t len = strlen(value);
+  if (len > 0xFF || writer->len + LEN_VALUE_HEADER + len > writer->size) {
+    return -1;
+  }
+  uint8_t* out = writer->buf + writer->len;
+  out[0] = VALUE_STRING;
+  out[1] = len;
+  memcpy(out + LEN_VALUE_HEADER, value, len);
+  writer->len += LEN_VALUE_HEADER + len;
+  return 0;
+}
+
+int tlv_next(const uint8_t* payload, uint16_t len, uint16_t* offset, tlv_t* tlv) {
+  if ((uint32_t)*offset + LEN_VALUE_HEADER > len) {
+    return -1;
+  }
+  tlv->type = payload[*offset];
+  tlv->len = payload[*offset + 1];
+  if ((uint32_t)*offset + LEN_VALUE_HEADER + tlv->len > len) {
+    return -1;
+  }
+  tlv->value = payload + *offset + LEN_VALUE_HEADER;
+  *offset += LEN_VALUE_HEADER + tlv->len;
+  return 0;
+}
+
+int32_t tlv_to_int(const tlv_t* tlv) {
+  if (tlv->type == VALUE_STRING || tlv->len == 0) {
+    return 0;
+  }
+  if (tlv->len == 1) {
+    return tlv->value[0];
+  }
+
+  uint16_t value = ((uint16_t)tlv->value[0] << 8) | tlv->value[1];
+  if (tlv->type == VALUE_I16 || tlv->type == VALUE_FIXED) {
+    return (int16_t)value;
+  }
+  return value;
+}
+
+uint16_t tlv_render(const uint8_t* payload, uint16_t len, char* output, uint16_t size) {
+  uint16_t offset = 0;
+  uint16_t written = 0;
+  tlv_t tlv;
+
+  if (size == 0) {
+    return 0;
+  }
+  output[0] = '\0';
+
+  while (tlv_next(payload, len, &offset, &tlv) == 0) {
+    char* out = output + written;
+    uint16_t room = size - written;
+    const char* separator = written > 0 ? "?" : "";
+    int32_t value = tlv_to_int(&tlv);
+    int n;
+
+    switch (tlv.type) {
+      case VALUE_BOOL:
+        n = snprintf(out, room, "%s%s", separator, value ? "on" : "off");
+        break;
+      case VALUE_FIXED:
+        n = snprintf(out, room, "%s%s%ld.%02u", separator, value < 0 ? "-" : "",
+          labs(value) >> 8, (unsigned)((labs(value) & 0xFF) * 100 / 256));
+        break;
+      case VALUE_STRING:
+        n = snprintf(out, room, "%s%.*s", separator, tlv.len, (const char*)tlv.value);
+        break;
+      default:
+        n = snprintf(out, room, "%s%ld", separator, (long)value);
+        break;
+    }
+
+    if (n < 0 || n >= room) {
+      /* Truncated, snprintf already terminated the text */
+      return size - 1;
+    }
+    written += n;
+  }
+  return written;
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* CONTROL PACKET HANDLING */
+
+
+/*---------------------------------------------------------------------------*/
+void build_control_header(control_header_t* control_header, uint8_t node_type, uint8_t response_type, linkaddr_t* dest) {
+  control_header->type = CONTROL;
+  control_header->node_type = node_type;
+  control_header->response_type = response_type;
+}
+
+void packing_control_packet(control_packet_t* control_packet, uint8_t* data, uint16_t len_of_data) {
+  data[0] = control_packet->header->type << 7;
+  data[0] |= control_packet->header->node_type << 5;
+  data[0] |= control_packet->header->response_type << 2;
+
+  /* Adding the data */
+  if (len_of_data > 0) {
+    memcpy(data + LEN_CONTROL_HEADER, control_packet->data, len_of_data);
+  }
+}
+
+void process_control_header(const uint8_t *data, uint16_t len, control_header_t* control_header) {
+  if (len == 0) {
+    LOG_INFO("Empty packet\n");
+    return;
+  }
+
+  uint8_t header = ((uint8_t *)data)[0];
+  control_header->type = header >> 7;
+  control_header->node_type = (header >> 5) & 0b11;
+  control_header->response_type = (header >> 2) & 0b111;
+}
+
+static void ack_batch_send(ack_batch_t* batch) {
+  batch->used = 0;
+  control_packet_send(batch->node_type, &batch->nexthop, DATA_ACK, batch->len, batch->buf);
+}
+
+/* Sends every collected ack, one DATA_ACK per next hop */
+static void ack_batch_flush() {
+  ctimer_stop(&ack_batch_timer);
+  for (uint8_t i = 0; i < ACK_BATCHES; i++) {
+    if (ack_batches[i].used) {
+      ack_batch_send(&ack_batches[i]);
+    }
+  }
+}
+
+/* Adds the ack of a node to the DATA_ACK of the next hop towards it,
+ * sent after the window or by ack_batch_flush if the window is 0 */
+static void ack_batch_add(uint8_t node_type, const linkaddr_t* nexthop, const linkaddr_t* acked, uint8_t seq, clock_time_t window) {
+  uint8_t entry[LEN_ADDR + 1];
+  uint8_t len_entry = packing_addr(entry, acked);
+  entry[len_entry++] = seq;
+
+  ack_batch_t* batch = NULL;
+  ack_batch_t* free_batch = NULL;
+  uint8_t pending = 0;
+  for (uint8_t i = 0; i < ACK_BATCHES; i++) {
+    if (!ack_batches[i].used) {
+      free_batch = free_batch == NULL ? &ack_batches[i] : free_batch;
+      continue;
+    }
+    pending = 1;
+    if (linkaddr_cmp(&ack_batches[i].nexthop, nexthop)) {
+      batch = &ack_batches[i];
+    }
+  }
+
+  if (batch != NULL && batch->len + len_entry > ACK_BATCH_MAX) {
+    ack_batch_send(batch);
+    free_batch = batch;
+    batch = NULL;
+  }
+  if (batch == NULL) {
+    if (free_batch == NULL) {
+      ack_batch_flush();
+      pending = 0;
+      free_batch = &ack_batches[0];
+    }
+    batch = free_batch;
+    batch->used = 1;
+    batch->node_type = node_type;
+    batch->nexthop = *nexthop;
+    batch->len = 0;
+  }
+
+  memcpy(batch->buf + batch->len, entry, len_entry);
+  batch->len += len_entry;
+  if (!pending && window > 0) {
+    ctimer_set(&ack_batch_timer, window, ack_batch_flush, NULL);
+  }
+}
+
+void process_route_update(const uint8_t* data, uint16_t len, linkaddr_t* src) {
+  uint16_t offset = 1;
+  while (offset < len) {
+    uint8_t op = data[offset] >> 7;
+    uint8_t multicast_group = data[offset] & 0xF;
+    linkaddr_t addr;
+    uint8_t len_addr = process_addr(data + offset + 1, len - offset - 1, &addr);
+    if (len_addr == 0) {
+      LOG_INFO("Malformed route update\n");
+      return;
+    }
+    offset += 1 + len_addr;
+
+    if (op == ROUTE_ADD) {
+      /* Our own address coming from below is a loop, the change goes no further */
+      if (linkaddr_cmp(&addr, &linkaddr_node_addr) || child_add(src, &addr, multicast_group) == -1) {
+        continue;
+      }
+      route_update_add(ROUTE_ADD, multicast_group, &addr);
+      continue;
+    }
+
+    /* A child reached through another next hop has moved, its entry is still good */
+    int index = find_child_slot(&addr);
+    if (index == -1 || !linkaddr_cmp(&children[index].from, src)) {
+      continue;
+    }
+    LOG_INFO("Child expired below: ");
+    LOG_INFO_LLADDR(&addr);
+    LOG_INFO_("\n");
+    child_remove(index);
+    route_update_add(ROUTE_REMOVE, 0, &addr);
+  }
+}
+
+void process_data_ack(const uint8_t* data, uint16_t len, linkaddr_t* src){
+  if (len < 1 || len - 1 > FRAME_MTU) {
+    return;
+  }
+  ack_heard_from = *src;
+  ack_heard = clock_time();
+
+  /* The list is copied, sending a split list overwrites the packet buffer */
+  uint8_t* acks = frame_acquire();
+  if (acks == NULL) {
+    return;
+  }
+  uint16_t len_acks = len - 1;
+  memcpy(acks, data + 1, len_acks);
+
+  uint16_t offset = 0;
+  while (offset < len_acks) {
+    linkaddr_t dest;
+    uint8_t len_addr = process_addr(acks + offset, len_acks - offset, &dest);
+    if (len_addr == 0 || offset + len_addr + 1 > len_acks) {
+      LOG_INFO("Malformed data ack\n");
+      break;
+    }
+    uint8_t seq = acks[offset + len_addr];
+    offset += len_addr + 1;
+
+    if (linkaddr_cmp(&dest, &linkaddr_node_addr)){
+      LOG_INFO("Ack of seq %u reached destination\n", seq);
+      ack_window_ack(src, seq);
+      continue;
+    }
+    linkaddr_t nexthop;
+    if (get_children(&dest, &nexthop) == -1) {
+      LOG_INFO("No children found\n");
+      continue;
+    }
+    ack_batch_add(0, &nexthop, &dest, seq, 0);
+  }
+
+  /* Split right away, only the gateway waits to collect acks */
+  ack_batch_flush();
+  frame_release(acks);
+}
+/*---------------------------------------------------------------------------*/
+
+
+/* CONTROL PACKET SENDING */
+
+
+/*---------------------------------------------------------------------------*/
+void control_packet_send(uint8_t node_type, linkaddr_t* dest, uint8_t response_type, uint16_t len_of_data, void* control_data) {
+  control_packet_t control_packet;
+  control_header_t header;
+  build_control_header(&header, node_type, response_type, dest);
+  control_packet.header = &header;
+  control_packet.data = control_data;
 
-    const linkaddr_t dest = parent->parent_addr;
-    LOG_INFO("Forwarding data packet to: ");
-    LOG_INFO_LLADDR(&dest);
-    LOG_INFO_("\n");
-    NETSTACK_NETWORK.output(&dest);
+  if (LEN_HEADER + LEN_CONTROL_HEADER + len_of_data > FRAME_MTU) {
+    LOG_WARN("Control packet too large: %u bytes\n", len_of_data);
     return;
   }
 
-  /* Forwarding to all child of the multicast group */
-
-  linkaddr_t nexthop;
-  linkaddr_t sent_nexthop[children_count];
-  int sent_count = 0;
-  int start_index = get_multicast_children(data_packet.header.multicast_group, &nexthop, 0);
-  while (start_index != -1) {
-    /* Changing the dest value */
-    // ((linkaddr_t*)data)[1] = nexthop;
-    memcpy(output + sizeof(linkaddr_t), &nexthop, sizeof(linkaddr_t));
-    nullnet_buf = output;
-    nullnet_len = len;
+  uint8_t* output = frame_acquire();
+  if (output == NULL) {
+    return;
+  }
+  uint8_t len_header = packing_link_header(output, dest == NULL ? &null_addr : dest);
+  packing_control_packet(&control_packet, output + len_header, len_of_data);
 
-    LOG_INFO("Forwarding data packet to: ");
-    LOG_INFO_LLADDR(&nexthop);
-    LOG_INFO_("\n");
-    NETSTACK_NETWORK.output(&nexthop);
-    sent_nexthop[sent_count] = nexthop;
-    sent_count++;
-
-    start_index = get_multicast_children(data_packet.header.multicast_group, &nexthop, start_index + 1);
-    while (start_index != -1) {
-      uint8_t found = 0;
-      for (int i = 0; i < sent_count; i++) {
-        if (linkaddr_cmp(&sent_nexthop[i], &nexthop)) {
-          found = 1;
-          break;
-        }
-      }
-      if (!found) {
-        break;
-      }
-      start_index = get_multicast_children(data_packet.header.multicast_group, &nexthop, start_index + 1);
-    }
-  }  
-}
+  LOG_INFO("Sending control packet to: ");
+  LOG_INFO_LLADDR(dest);
+  LOG_INFO_("\n");
 
-void keep_alive(parent_t* parent, char* name) {
-  LOG_INFO("Sending keep alive packet\n");
-  uint16_t len_topic = strlen("keep_alive");
-  uint16_t len_data = strlen(name);
-  send_data_packet(1, UNICAST_GROUP, len_topic, len_data, "keep_alive", name, &parent->parent_addr, 1, NOT_MOBILE);
+  frame_send(output, len_header + LEN_CONTROL_HEADER + len_of_data, dest, TX_CONTROL);
 }
 /*---------------------------------------------------------------------------*/
 
 
-/* CONTROL PACKET HANDLING */
+/* PARENT DECISIONNING */
 
 
 /*---------------------------------------------------------------------------*/
-void build_control_header(control_header_t* control_header, uint8_t node_type, uint8_t response_type, linkaddr_t* dest) {
-  control_header->type = CONTROL;
-  control_header->node_type = node_type;
-  control_header->response_type = response_type;
-}
+/* LINK ESTIMATION */
 
-void packing_control_packet(control_packet_t* control_packet, uint8_t* data, uint16_t len_of_data) {
-  data[0] = control_packet->header->type << 7;
-  data[0] |= control_packet->header->node_type << 5;
-  data[0] |= control_packet->header->response_type << 2;
 
-  /* Adding the data */
-  if (len_of_data > 0) {
-    memcpy(data + LEN_CONTROL_HEADER, control_packet->data, len_of_data);
+/*---------------------------------------------------------------------------*/
+#define LINK_AVG_SCALE 16
+/* Expected transmissions guessed for a link without acks yet,
+   one more every 8 dB under LINK_RSSI_GOOD and every 16 LQI under LINK_LQI_GOOD */
+#define LINK_RSSI_GOOD (-75)
+#define LINK_LQI_GOOD 100
+
+static link_entry_t* link_find(const linkaddr_t* addr) {
+  for (uint8_t i = 0; i < LINK_NEIGHBORS; i++) {
+    if (links[i].used && linkaddr_cmp(&links[i].addr, addr)) {
+      return &links[i];
+    }
   }
+  return NULL;
 }
 
-void process_control_header(const uint8_t *data, uint16_t len, control_header_t* control_header) {
-  if (len == 0) {
-    LOG_INFO("Empty packet\n");
-    return;
+/* The current parent is never replaced, its estimate is what candidates are compared to */
+static link_entry_t* link_add(const linkaddr_t* addr) {
+  link_entry_t* link = NULL;
+  for (uint8_t i = 0; i < LINK_NEIGHBORS; i++) {
+    if (!links[i].used) {
+      link = &links[i];
+      break;
+    }
+    if (current_parent != NULL && linkaddr_cmp(&links[i].addr, &current_parent->parent_addr)) {
+      continue;
+    }
+    if (link == NULL || (long)(links[i].heard - link->heard) < 0) {
+      link = &links[i];
+    }
   }
+  memset(link, 0, sizeof(link_entry_t));
+  link->used = 1;
+  link->addr = *addr;
+  return link;
+}
 
-  uint8_t header = ((uint8_t *)data)[0];
-  control_header->type = header >> 7;
-  control_header->node_type = (header >> 5) & 0b11;
-  control_header->response_type = (header >> 2) & 0b111;
+static void link_rx_sample(const linkaddr_t* addr, signed char rssi, uint8_t lqi) {
+  link_entry_t* link = link_find(addr);
+  if (link == NULL) {
+    link = link_add(addr);
+    link->rssi = rssi * LINK_AVG_SCALE;
+    link->lqi = lqi * LINK_AVG_SCALE;
+  } else {
+    /* Moving averages over about 8 frames */
+    link->rssi += (rssi * LINK_AVG_SCALE - link->rssi) / 8;
+    link->lqi += (int16_t)(lqi * LINK_AVG_SCALE - link->lqi) / 8;
+  }
+  link->heard = clock_time();
 }
 
-void process_data_ack(const uint8_t* data, linkaddr_t* src){
-  linkaddr_t dest =*((linkaddr_t*) (data+1));
-  if (linkaddr_cmp(&dest, &linkaddr_node_addr)){
-    LOG_INFO("Ack reached destination\n");
-    data_counter--;
+static void link_etx_sample(const linkaddr_t* addr, uint8_t transmissions) {
+  link_entry_t* link = link_find(addr);
+  if (link == NULL) {
     return;
   }
-  linkaddr_t nexthop;
-  get_children(&dest, &nexthop);
-  if (linkaddr_cmp(&nexthop, NULL)) {
-    LOG_INFO("No children found\n");
-    return;
+  uint16_t sample = transmissions * LINK_ETX_DIVISOR;
+  /* Faster than the signal averages, a link going bad must show within a few packets */
+  link->etx = link->etx_samples == 0 ? sample : (link->etx * 3 + sample) / 4;
+  if (link->etx_samples < 0xFF) {
+    link->etx_samples++;
   }
-  
-  control_packet_send(0, &nexthop, DATA_ACK, sizeof(linkaddr_t), &dest);
+}
+
+/* ETX guessed from the signal of the frames heard on the link alone */
+static uint16_t link_hop_cost(const link_entry_t* link) {
+  if (link == NULL) {
+    return 0xFFFF;
+  }
+  uint16_t cost = LINK_ETX_DIVISOR;
+  int16_t rssi = link->rssi / LINK_AVG_SCALE;
+  int16_t lqi = link->lqi / LINK_AVG_SCALE;
+  if (rssi < LINK_RSSI_GOOD) {
+    cost += (LINK_RSSI_GOOD - rssi) * LINK_ETX_DIVISOR / 8;
+  }
+  if (lqi < LINK_LQI_GOOD) {
+    cost += (LINK_LQI_GOOD - lqi) * LINK_ETX_DIVISOR / 16;
+  }
+  return cost;
+}
+
+/* ETX once packets were acked through the link, a guess from the signal before */
+static uint16_t link_cost(const link_entry_t* link) {
+  if (link != NULL && link->etx_samples > 0) {
+    return link->etx;
+  }
+  return link_hop_cost(link);
+}
 
+int link_estimate(const linkaddr_t* addr, link_estimate_t* estimate) {
+  link_entry_t* link = link_find(addr);
+  if (link == NULL) {
+    return -1;
+  }
+  estimate->rssi = link->rssi / LINK_AVG_SCALE;
+  estimate->lqi = link->lqi / LINK_AVG_SCALE;
+  estimate->etx = link->etx;
+  estimate->etx_samples = link->etx_samples;
+  estimate->cost = link_cost(link);
+  return 0;
 }
 /*---------------------------------------------------------------------------*/
 
 
-/* CONTROL PACKET SENDING */
+/* PARENT DECISIONNING */
 
 
 /*---------------------------------------------------------------------------*/
-void control_packet_send(uint8_t node_type, linkaddr_t* dest, uint8_t response_type, uint16_t len_of_data, void* control_data) {
-  control_packet_t control_packet;
-  control_header_t header;
-  build_control_header(&header, node_type, response_type, dest);
-  control_packet.header = &header;
-  control_packet.data = control_data;
+/* Reads the hops and rank of a RESPONSE, data starts at the control header */
+static int process_rank(const uint8_t* data, uint16_t len, uint8_t* hops, uint16_t* rank) {
+  if (len < LEN_CONTROL_HEADER + 3) {
+    return -1;
+  }
+  *hops = data[LEN_CONTROL_HEADER];
+  *rank = ((uint16_t)data[LEN_CONTROL_HEADER + 1] << 8) | data[LEN_CONTROL_HEADER + 2];
+  return 0;
+}
 
-  uint8_t data[LEN_CONTROL_HEADER + len_of_data];
-  packing_control_packet(&control_packet, data, len_of_data);
+/* Rank advertised through a neighbour, RANK_INFINITE if the link is unknown.
+ * The ETX counts end to end acks, the losses upstream are already in the rank,
+ * so only the cost of this hop is added */
+static uint16_t path_cost(const linkaddr_t* addr, uint16_t rank) {
+  uint32_t cost = (uint32_t)rank + link_hop_cost(link_find(addr));
+  return cost < RANK_INFINITE ? cost : RANK_INFINITE;
+}
 
-  uint8_t output[LEN_HEADER + LEN_CONTROL_HEADER + len_of_data];
-  if (dest == NULL) {
-    packing_packet(output, &linkaddr_node_addr, &null_addr, data, len_of_data + LEN_CONTROL_HEADER);
-  } else {
-    packing_packet(output, &linkaddr_node_addr, dest, data, len_of_data + LEN_CONTROL_HEADER);
+static uint16_t own_rank() {
+  if (trickle_node_type == GATEWAY) {
+    return 0;
   }
+  if (not_setup() || current_parent == NULL) {
+    return RANK_INFINITE;
+  }
+  return path_cost(&current_parent->parent_addr, parent_rank);
+}
 
-  // memcpy(nullnet_buf, packet_space, 2*sizeof(linkaddr_t) + len_of_data + 1);
-  nullnet_buf = output;
-  nullnet_len = LEN_HEADER + LEN_CONTROL_HEADER + len_of_data;
+/* A candidate must beat the path through the parent by PARENT_SWITCH_HYSTERESIS, noise alone never does */
+static uint8_t rank_better(const linkaddr_t* candidate, uint16_t rank, const linkaddr_t* parent) {
+  uint16_t cost = path_cost(candidate, rank);
+  return cost != RANK_INFINITE && (uint32_t)cost + PARENT_SWITCH_HYSTERESIS < path_cost(parent, parent_rank);
+}
 
-  LOG_INFO("Sending control packet to: ");
-  LOG_INFO_LLADDR(dest);
-  LOG_INFO_("\n");
+/* A descendant would route through us, taking it as a parent makes a loop */
+static uint8_t rank_usable(const linkaddr_t* src, uint8_t hops, uint16_t rank) {
+  if (hops >= RANK_MAX_HOPS || rank == RANK_INFINITE) {
+    LOG_INFO("Ignoring parent without a usable path\n");
+    return 0;
+  }
+  if (find_child_slot(src) != -1) {
+    LOG_INFO("Ignoring parent among the children\n");
+    return 0;
+  }
+  return 1;
+}
 
-  NETSTACK_NETWORK.output(dest);
+static void join_parent(const linkaddr_t* src, uint8_t type, signed char rssi, uint8_t hops, uint16_t rank, parent_t* parent, uint8_t node_type, uint8_t multicast_group) {
+  parent_hops = hops;
+  parent_rank = rank;
+  set_parent(src, type, rssi, parent, node_type, multicast_group);
 }
-/*---------------------------------------------------------------------------*/
 
+static void backup_remove(const linkaddr_t* addr) {
+  for (uint8_t i = 0; i < backup_count; i++) {
+    if (linkaddr_cmp(&backup_parents[i].addr, addr)) {
+      backup_count--;
+      memmove(&backup_parents[i], &backup_parents[i + 1], (backup_count - i) * sizeof(backup_parent_t));
+      return;
+    }
+  }
+}
 
-/* PARENT DECISIONNING */
+/* Keeps the candidate if it is among the BACKUP_PARENTS cheapest paths, the list stays sorted */
+static void backup_offer(const linkaddr_t* addr, uint8_t type, signed char rssi, uint8_t hops, uint16_t rank) {
+  backup_remove(addr);
+
+  uint16_t cost = path_cost(addr, rank);
+  uint8_t index = 0;
+  while (index < backup_count && backup_parents[index].cost <= cost) {
+    index++;
+  }
+  if (index >= BACKUP_PARENTS) {
+    return;
+  }
+  if (backup_count < BACKUP_PARENTS) {
+    backup_count++;
+  }
+  memmove(&backup_parents[index + 1], &backup_parents[index], (backup_count - 1 - index) * sizeof(backup_parent_t));
+  backup_parents[index].addr = *addr;
+  backup_parents[index].type = type;
+  backup_parents[index].rssi = rssi;
+  backup_parents[index].hops = hops;
+  backup_parents[index].rank = rank;
+  backup_parents[index].cost = cost;
+}
+
+/* Joins the best other candidate with a single SETUP_ACK, -1 if there is none left */
+static int parent_failover(parent_t* parent) {
+  backup_remove(&parent->parent_addr);
+  if (backup_count == 0) {
+    return -1;
+  }
 
+  /* A dead backup fails the same way and the next one is tried */
+  backup_parent_t* backup = &backup_parents[0];
+  LOG_INFO("Switching to backup parent: ");
+  LOG_INFO_LLADDR(&backup->addr);
+  LOG_INFO_("\n");
+  join_parent(&backup->addr, backup->type, backup->rssi, backup->hops, backup->rank, parent, parent_node_type, parent_multicast_group);
+  return 0;
+}
 
-/*---------------------------------------------------------------------------*/
-void check_parent_node(const linkaddr_t* src, uint8_t node_type, parent_t* parent, uint8_t multicast_group) {
-  /* Create new possible parent */
-  signed char rssi = cc2420_last_rssi;
+void check_parent_node(const linkaddr_t* src, uint8_t node_type, uint8_t hops, uint16_t rank, parent_t* parent, uint8_t multicast_group) {
+  /* Create new possible parent, with the averages of its link */
+  link_estimate_t estimate;
+  if (link_estimate(src, &estimate) == -1) {
+    return;
+  }
+  signed char rssi = estimate.rssi;
 
   if (node_type == GATEWAY) {
     LOG_INFO("Ignoring gateway\n");
     return;
   }
+  if (!rank_usable(src, hops, rank)) {
+    return;
+  }
+  backup_offer(src, node_type, rssi, hops, rank);
 
   if (not_setup()) {
     setup = 1;
-    set_parent(src, node_type, rssi, parent, NODE, multicast_group);
+    join_parent(src, node_type, rssi, hops, rank, parent, NODE, multicast_group);
     LOG_INFO("First parent setup\n");
     return;
   }
 
-  /* If the new parent is better than the current one */
-  if (parent->type < node_type) {
-    set_parent(src, node_type, rssi, parent, NODE, multicast_group);
-    LOG_INFO("Better parent found\n");
+  /* The parent moved in the tree, so did we */
+  if (linkaddr_cmp(&parent->parent_addr, src)) {
+    parent_hops = hops;
+    parent_rank = rank;
     return;
   }
 
-  /* If the new parent is the same as the current one */
-  if (
-      type_parent == node_type &&
-      parent->rssi < rssi
-      ) 
-  {
-    set_parent(src, node_type, rssi, parent, NODE, multicast_group);
-    LOG_INFO("Better parent found\n");
+  /* If the path through the new parent is cheaper, whatever its type */
+  if (rank_better(src, rank, &parent->parent_addr)) {
+    join_parent(src, node_type, rssi, hops, rank, parent, NODE, multicast_group);
+    LOG_INFO("Better parent found, rank %u\n", path_cost(src, rank));
     return;
   }
   LOG_INFO("Parent poopoo\n");
 }
 
-void check_parent_sub_gateway(const linkaddr_t* src, uint8_t node_type, parent_t* parent) {
-  /* Create new possible parent */
-  signed char rssi = cc2420_last_rssi;
+void check_parent_sub_gateway(const linkaddr_t* src, uint8_t node_type, uint8_t hops, uint16_t rank, parent_t* parent) {
+  /* Create new possible parent, with the averages of its link */
+  link_estimate_t estimate;
+  if (link_estimate(src, &estimate) == -1) {
+    return;
+  }
+  signed char rssi = estimate.rssi;
 
   if (node_type != GATEWAY) {
     LOG_INFO("Ignoring not a gateway\n");
     return;
   }
+  if (!rank_usable(src, hops, rank)) {
+    return;
+  }
+  backup_offer(src, node_type, rssi, hops, rank);
 
   if (not_setup()) {
     setup = 1;
-    set_parent(src, node_type, rssi, parent, SUB_GATEWAY, UNICAST_GROUP);
+    join_parent(src, node_type, rssi, hops, rank, parent, SUB_GATEWAY, UNICAST_GROUP);
     LOG_INFO("First parent setup\n");
     return;
   }
 
   /* If the new parent is the same as the current one */
-  if (parent->rssi < rssi) 
+  if (!linkaddr_cmp(&parent->parent_addr, src) && rank_better(src, rank, &parent->parent_addr)) 
   {
-    set_parent(src, node_type, rssi, parent, SUB_GATEWAY, UNICAST_GROUP);
+    join_parent(src, node_type, rssi, hops, rank, parent, SUB_GATEWAY, UNICAST_GROUP);
     LOG_INFO("Better parent found\n");
     return;
   }
@@ -490,17 +2534,250 @@ void check_parent_sub_gateway(const linkaddr_t* src, uint8_t node_type, parent_t
 /*---------------------------------------------------------------------------*/
 
 
+/* CHECKPOINT */
+
+
+/*---------------------------------------------------------------------------*/
+#if ROUTING_CHECKPOINT
+/* Bytes of the checkpoint, always into the crc, to the file unless fd is -1 */
+static int checkpoint_put(int fd, const uint8_t* data, uint16_t len, uint16_t* crc) {
+  *crc = crc16_data(data, len, *crc);
+  return fd < 0 || cfs_write(fd, data, len) == len ? 0 : -1;
+}
+
+static int checkpoint_image(int fd, uint16_t* crc) {
+  uint8_t buf[2 * LEN_ADDR + 9];
+  uint16_t len = 0;
+  uint8_t has_parent = current_parent != NULL && !not_setup();
+  *crc = 0;
+
+  buf[len++] = CHECKPOINT_VERSION;
+  buf[len++] = trickle_node_type;
+  buf[len++] = has_parent;
+  if (has_parent) {
+    len += packing_addr(buf + len, &current_parent->parent_addr);
+    buf[len++] = current_parent->type;
+    buf[len++] = parent_node_type;
+    buf[len++] = parent_multicast_group;
+    buf[len++] = parent_hops;
+    memcpy(buf + len, &parent_rank, sizeof(uint16_t));
+    len += sizeof(uint16_t);
+  }
+  memcpy(buf + len, &children_count, sizeof(uint16_t));
+  len += sizeof(uint16_t);
+  if (checkpoint_put(fd, buf, len, crc) == -1) {
+    return -1;
+  }
+
+  for (uint16_t i = 0; i < CHILDREN_TABLE_SIZE; i++) {
+    if (!children_used[i]) {
+      continue;
+    }
+    uint8_t direct = linkaddr_cmp(&children[i].addr, &children[i].from);
+    buf[0] = direct << 7 | children[i].multicast_group;
+    len = 1 + packing_addr(buf + 1, &children[i].addr);
+    if (!direct) {
+      len += packing_addr(buf + len, &children[i].from);
+    }
+    if (checkpoint_put(fd, buf, len, crc) == -1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Rewrites the whole file, unless nothing changed since the last write */
+static void checkpoint_write(void* ptr) {
+  uint16_t crc;
+  checkpoint_image(-1, &crc);
+  if (checkpoint_saved && crc == checkpoint_crc) {
+    LOG_INFO("Checkpoint unchanged\n");
+    return;
+  }
+
+  cfs_remove(CHECKPOINT_FILE);
+  int fd = cfs_open(CHECKPOINT_FILE, CFS_WRITE);
+  if (fd < 0) {
+    LOG_WARN("Checkpoint not opened\n");
+    return;
+  }
+  if (checkpoint_image(fd, &crc) == -1 || cfs_write(fd, &crc, sizeof(uint16_t)) != sizeof(uint16_t)) {
+    LOG_WARN("Checkpoint not written\n");
+    cfs_close(fd);
+    cfs_remove(CHECKPOINT_FILE);
+    checkpoint_saved = 0;
+    return;
+  }
+  cfs_close(fd);
+  checkpoint_saved = 1;
+  checkpoint_crc = crc;
+  LOG_INFO("Checkpoint written, %u children\n", children_count);
+}
+
+static int checkpoint_get(int fd, uint8_t* data, uint16_t len, uint16_t* crc) {
+  if (cfs_read(fd, data, len) != len) {
+    return -1;
+  }
+  *crc = crc16_data(data, len, *crc);
+  return 0;
+}
+
+/* Encoded addresses have the length given by their first byte */
+static int checkpoint_get_addr(int fd, linkaddr_t* addr, uint16_t* crc) {
+  uint8_t buf[LEN_ADDR];
+  uint8_t len = LEN_ADDR;
+#if COMPRESS_HEADER
+  if (checkpoint_get(fd, buf, 1, crc) == -1) {
+    return -1;
+  }
+  len = buf[0] & ADDR_SHORT ? 2 : LEN_ADDR;
+  if (checkpoint_get(fd, buf + 1, len - 1, crc) == -1) {
+    return -1;
+  }
+#else
+  if (checkpoint_get(fd, buf, len, crc) == -1) {
+    return -1;
+  }
+#endif
+  return process_addr(buf, len, addr) == 0 ? -1 : 0;
+}
+
+/* Checks the whole file first, apply only reads it again to fill the tables */
+static int checkpoint_read(int fd, uint8_t node_type, parent_t* parent, uint8_t apply) {
+  uint16_t crc = 0;
+  uint8_t head[3];
+  if (
+    checkpoint_get(fd, head, sizeof(head), &crc) == -1 ||
+    head[0] != CHECKPOINT_VERSION || head[1] != node_type
+  ) {
+    return -1;
+  }
+
+  if (head[2]) {
+    linkaddr_t addr;
+    uint8_t info[4 + sizeof(uint16_t)];
+    if (checkpoint_get_addr(fd, &addr, &crc) == -1 || checkpoint_get(fd, info, sizeof(info), &crc) == -1) {
+      return -1;
+    }
+    if (apply) {
+      linkaddr_copy(&parent->parent_addr, &addr);
+      parent->type = info[0];
+      parent->rssi = 0;
+      type_parent = info[0];
+      current_parent = parent;
+      parent_node_type = info[1];
+      parent_multicast_group = info[2];
+      parent_hops = info[3];
+      memcpy(&parent_rank, info + 4, sizeof(uint16_t));
+      setup = 1;
+    }
+  }
+
+  uint16_t count;
+  if (checkpoint_get(fd, (uint8_t*)&count, sizeof(uint16_t), &crc) == -1) {
+    return -1;
+  }
+  for (uint16_t i = 0; i < count; i++) {
+    uint8_t flags;
+    linkaddr_t addr;
+    if (checkpoint_get(fd, &flags, 1, &crc) == -1 || checkpoint_get_addr(fd, &addr, &crc) == -1) {
+      return -1;
+    }
+    linkaddr_t from = addr;
+    if (!(flags >> 7) && checkpoint_get_addr(fd, &from, &crc) == -1) {
+      return -1;
+    }
+    if (apply) {
+      child_add(&from, &addr, flags & 0xF);
+    }
+  }
+
+  uint16_t stored;
+  if (cfs_read(fd, &stored, sizeof(uint16_t)) != sizeof(uint16_t) || stored != crc) {
+    return -1;
+  }
+  if (apply) {
+    checkpoint_saved = 1;
+    checkpoint_crc = crc;
+  }
+  return 0;
+}
+
+/* The probe, or any traffic acked by the parent since the restore, shows the path still works */
+static void restore_check(void* ptr) {
+  parent_t* parent = (parent_t*) ptr;
+  if (
+    not_setup() ||
+    (linkaddr_cmp(&ack_heard_from, &parent->parent_addr) && (long)(ack_heard - restore_time) >= 0)
+  ) {
+    return;
+  }
+  LOG_WARN("Restored parent never acked the probe\n");
+  if (parent_failover(parent) == -1) {
+    setup = 0;
+    trickle_reset();
+  }
+}
+#endif
+
+/* The gateway and the mobile nodes keep nothing, the first change arms a single write */
+static void checkpoint_mark() {
+#if ROUTING_CHECKPOINT
+  if (trickle_node_type != NODE && trickle_node_type != SUB_GATEWAY) {
+    return;
+  }
+  if (ctimer_expired(&checkpoint_timer)) {
+    ctimer_set(&checkpoint_timer, CHECKPOINT_DELAY, checkpoint_write, NULL);
+  }
+#endif
+}
+
+int routing_restore(parent_t* parent, uint8_t node_type) {
+  int restored = -1;
+#if ROUTING_CHECKPOINT
+  int fd = cfs_open(CHECKPOINT_FILE, CFS_READ);
+  if (fd >= 0) {
+    if (checkpoint_read(fd, node_type, parent, 0) == 0 && cfs_seek(fd, 0, CFS_SEEK_SET) == 0) {
+      restored = checkpoint_read(fd, node_type, parent, 1);
+    }
+    cfs_close(fd);
+  }
+#endif
+  trickle_start(node_type);
+  if (restored == -1) {
+    LOG_INFO("No checkpoint restored\n");
+    return -1;
+  }
+  LOG_INFO("Checkpoint restored, %u children\n", children_count);
+
+#if ROUTING_CHECKPOINT
+  /* A single keep alive, acked only if the parent and the path above still know us.
+   * Without a payload, the gateway acks it but does not print it */
+  if (!not_setup()) {
+    uint8_t probe[1];
+    restore_time = clock_time();
+    send_data_packet(1, UNICAST_GROUP, TOPIC_KEEP_ALIVE, 0, probe, &parent->parent_addr, 1, NOT_MOBILE);
+    ctimer_set(&restore_timer, RESTORE_PROBE_TIMEOUT, restore_check, parent);
+  }
+#endif
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+
+
 /* PACKET PROCESSING */
 
 
 /*---------------------------------------------------------------------------*/
 void process_node_packet(const void *data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type, parent_t* parent, uint8_t multicast_group) {
-  if (len == 0) {
+  uint8_t len_header = packet_header_len(data, len);
+  if (len_header == 0 || len <= len_header) {
     LOG_INFO("Empty packet\n");
     return;
   }
   
-  const void* data_strip = data + sizeof(linkaddr_t) * 2;
+  const void* data_strip = data + len_header;
+  uint16_t len_strip = len - len_header;
 
   uint8_t head = ((uint8_t *)data_strip)[0];
   *packet_type = head >> 7;
@@ -510,23 +2787,36 @@ void process_node_packet(const void *data, uint16_t len, linkaddr_t *src, linkad
     control_header_t header;
     process_control_header(data_strip, len, &header);
 
-    if (header.node_type == SUB_GATEWAY && header.response_type == RESPONSE) {
-      check_parent_node(src, header.node_type, parent, multicast_group);
+    uint8_t hops;
+    uint16_t rank;
+    if (
+      header.node_type == SUB_GATEWAY && header.response_type == RESPONSE &&
+      process_rank(data_strip, len_strip, &hops, &rank) == 0
+    ) {
+      check_parent_node(src, header.node_type, hops, rank, parent, multicast_group);
       return;
     }
 
     if (header.response_type == CHILD_RM) {
       LOG_INFO("Received child remove control packet\n");
-      rm_child((linkaddr_t*)(data_strip + 1));
+      linkaddr_t addr;
+      if (process_addr(data_strip + 1, len_strip - 1, &addr) != 0) {
+        rm_child(&addr);
+      }
+      return;
+    }
+
+    if (header.response_type == ROUTE_UPDATE) {
+      process_route_update(data_strip, len_strip, src);
       return;
     }
 
-    /* Sending back a control packet to the source
-     * if setup is not done
+    /* A neighbour looks for a parent, beaconing fast again
+     * if setup is done
     */
     if (!not_setup() && header.response_type == SETUP) {
-      LOG_INFO("Sending response control packet\n");
-      control_packet_send(NODE, src, RESPONSE, 0, NULL);
+      LOG_INFO("Neighbour looking for a parent\n");
+      trickle_reset();
       return;
     }
 
@@ -537,16 +2827,21 @@ void process_node_packet(const void *data, uint16_t len, linkaddr_t *src, linkad
 
     if (header.response_type == RESPONSE) {
       LOG_INFO("Received response control packet\n");
-      check_parent_node(src, header.node_type, parent, multicast_group);
+      if (process_rank(data_strip, len_strip, &hops, &rank) == 0) {
+        check_parent_node(src, header.node_type, hops, rank, parent, multicast_group);
+      }
       return;
     }
 
     if (header.response_type == SETUP_ACK) {
-      set_child(src, (uint8_t*)data_strip);
-      child_t new_child = children[children_count - 1];
+      int index = set_child(src, data_strip, len_strip);
+      if (index == -1) {
+        return;
+      }
+      child_t new_child = children[index];
 
       /* Forwarding child to gateway */
-      send_child(new_child, NODE, parent);
+      send_child(new_child);
 
       LOG_INFO("Received setup ack control packet new children at address: ");
       LOG_INFO_LLADDR(&new_child.addr);
@@ -555,7 +2850,7 @@ void process_node_packet(const void *data, uint16_t len, linkaddr_t *src, linkad
     }
 
     if (header.response_type == DATA_ACK) {
-      process_data_ack(data_strip, src);
+      process_data_ack(data_strip, len_strip, src);
       return;
     }
 
@@ -573,13 +2868,30 @@ void process_node_packet(const void *data, uint16_t len, linkaddr_t *src, linkad
   }
 }
 
+/* Packs a mobile query or response going down in a pool frame and forwards it */
+static void send_mobile_down(data_packet_t* data_packet, linkaddr_t* src, parent_t* parent) {
+  uint16_t len_data_packet = get_data_packet_len(data_packet);
+  if (len_data_packet + LEN_HEADER > FRAME_MTU) {
+    LOG_WARN("Mobile packet too large: %u bytes\n", len_data_packet);
+    return;
+  }
+
+  /* Built in the datagram buffer, forward_data_packet copies it to the frames it queues */
+  uint8_t* output = datagram_buf;
+  uint8_t len_header = packing_header(output, src, &null_addr);
+  packing_data_packet(data_packet, output + len_header);
+  forward_data_packet(output, len_data_packet + len_header, parent);
+}
+
 void process_sub_gateway_packet(const uint8_t* data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type, parent_t* parent) {
-  if (len == 0) {
+  uint8_t len_header = packet_header_len(data, len);
+  if (len_header == 0 || len <= len_header) {
     LOG_INFO("Empty packet\n");
     return;
   }
 
-  const void* data_strip = data + sizeof(linkaddr_t) * 2;
+  const void* data_strip = data + len_header;
+  uint16_t len_strip = len - len_header;
 
   uint8_t head = ((uint8_t *)data_strip)[0];
   uint8_t type = head >> 7;
@@ -591,11 +2903,14 @@ void process_sub_gateway_packet(const uint8_t* data, uint16_t len, linkaddr_t *s
     process_control_header(data_strip, len, &header);
 
     if (header.response_type == SETUP_ACK) {
-      set_child(src, (uint8_t*)data_strip);
-      child_t new_child = children[children_count - 1];
+      int index = set_child(src, data_strip, len_strip);
+      if (index == -1) {
+        return;
+      }
+      child_t new_child = children[index];
 
       /* Forwarding child to gateway */
-      send_child(new_child, SUB_GATEWAY, parent);
+      send_child(new_child);
 
       LOG_INFO("Received setup ack control packet new children at address: ");
       LOG_INFO_LLADDR(&new_child.addr);
@@ -605,23 +2920,35 @@ void process_sub_gateway_packet(const uint8_t* data, uint16_t len, linkaddr_t *s
 
     if (header.response_type == CHILD_RM) {
       LOG_INFO("Received child remove control packet\n");
-      rm_child((linkaddr_t*)(data_strip + 1));
+      linkaddr_t addr;
+      if (process_addr(data_strip + 1, len_strip - 1, &addr) != 0) {
+        rm_child(&addr);
+      }
+      return;
+    }
+
+    if (header.response_type == ROUTE_UPDATE) {
+      process_route_update(data_strip, len_strip, src);
       return;
     }
 
     if (header.response_type == DATA_ACK) {
-      process_data_ack(data_strip, src);
+      process_data_ack(data_strip, len_strip, src);
       return;
     }
 
-    if (header.response_type <= 1 && header.node_type == GATEWAY) {
-      check_parent_sub_gateway(src, header.node_type, parent);
+    uint8_t hops;
+    uint16_t rank;
+    if (header.response_type == RESPONSE && header.node_type == GATEWAY) {
+      if (process_rank(data_strip, len_strip, &hops, &rank) == 0) {
+        check_parent_sub_gateway(src, header.node_type, hops, rank, parent);
+      }
       return;
     }
 
     if (!not_setup() && header.response_type == SETUP && header.node_type != SUB_GATEWAY) {
-      LOG_INFO("Sending back a control packet\n");
-      control_packet_send(SUB_GATEWAY, src, RESPONSE, 0, NULL);
+      LOG_INFO("Neighbour looking for a parent\n");
+      trickle_reset();
       return;
     }
   }
@@ -631,47 +2958,64 @@ void process_sub_gateway_packet(const uint8_t* data, uint16_t len, linkaddr_t *s
   }
 
   if (*packet_type == DATA) {
+    data_packet_view_t data_view;
+    if (process_data_view(data, len, &data_view) == -1) {
+      LOG_INFO("Ignoring malformed data packet\n");
+      return;
+    }
     data_packet_t data_packet;
-    process_data_packet(data, len, &data_packet);
+    data_packet_from_view(&data_view, &data_packet);
+
     if (data_packet.header.mobile_flags == NOT_MOBILE){
-      forward_data_packet(data, len, parent);
+      /* Upward data of the children is sent to the gateway in aggregates */
+      if (
+        data_packet.header.up == 0 ||
+        data_packet.header.topic == TOPIC_AGGREGATE ||
+        aggregate_data_packet(&data_view, src, parent) == -1
+      ) {
+        forward_data_packet(data, len, parent);
+      }
     }
-    if (data_packet.header.mobile_flags == DATA_QUERY){
+    tlv_t target;
+    uint16_t offset = 0;
+    if (data_packet.header.mobile_flags == DATA_QUERY && tlv_next(data_packet.data, data_packet.header.len_data, &offset, &target) == 0){
       LOG_INFO("Received data query\n");
-      uint64_t len_data_packet = data_packet.header.len_data + data_packet.header.len_topic + LEN_DATA_HEADER + sizeof(linkaddr_t);
-      uint8_t new_data[len_data_packet];
 
-      //modif data packet
+      //modif data packet, the first value is the queried multicast group
       data_packet.header.up = 0;
-      data_packet.header.multicast_group = data_packet.data[0];
+      data_packet.header.multicast_group = tlv_to_int(&target) & 0xF;
 
-      packing_data_packet(&data_packet, new_data);
-      uint8_t output[len_data_packet + LEN_HEADER];
-      packing_packet(output, src, NULL, new_data, len_data_packet);
-      forward_data_packet(output, len_data_packet + LEN_HEADER, parent);
-      LOG_INFO("Data packet converted and sent to multicast group nb : %u\n", data_packet.data[0]);
+      send_mobile_down(&data_packet, src, parent);
+      LOG_INFO("Data packet converted and sent to multicast group nb : %u\n", data_packet.header.multicast_group);
     }
     if (data_packet.header.mobile_flags == DATA_RESPONSE){
       LOG_INFO("Received data response\n");
-      uint64_t len_data_packet = data_packet.header.len_data + data_packet.header.len_topic + LEN_DATA_HEADER + sizeof(linkaddr_t);
-      uint8_t new_data[len_data_packet];
 
       //modif data packet
       data_packet.header.up = 0;
 
-      packing_data_packet(&data_packet, new_data);
-      uint8_t output[len_data_packet + LEN_HEADER];
-      packing_packet(output, src, NULL, new_data, len_data_packet);
-      forward_data_packet(output, len_data_packet + LEN_HEADER, parent);
+      send_mobile_down(&data_packet, src, parent);
     }
+    return;
+  }
+}
 
-    free(data_packet.topic);
-    free(data_packet.data);
+/* Acks the data of a node, through the next hop it is reachable by */
+static void send_data_ack(linkaddr_t* origin, uint8_t seq) {
+  if (seq == 0) {
+    /* No ack requested */
+    return;
+  }
+  linkaddr_t nexthop;
+  if (get_children(origin, &nexthop) == -1) {
+    LOG_INFO("No children found\n");
     return;
   }
+
+  ack_batch_add(GATEWAY, &nexthop, origin, seq, ACK_BATCH_WINDOW);
 }
 
-void process_gateway_packet(const void *data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type, linkaddr_t* barns, int* barns_size) {
+void process_gateway_packet(const void *data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type) {
   if (len == 0) {
     LOG_INFO("Empty packet\n");
     return;
@@ -691,65 +3035,75 @@ void process_gateway_packet(const void *data, uint16_t len, linkaddr_t *src, lin
     }
 
     if (header.response_type == SETUP_ACK) {
-      set_child(src, (uint8_t*)data);
-      child_t new_child = children[children_count - 1];
+      int index = set_child(src, data, len);
+      if (index == -1) {
+        return;
+      }
       LOG_INFO("Received setup ack control packet\n");
       LOG_INFO("New children at address: ");
-      LOG_INFO_LLADDR(&new_child.addr);
+      LOG_INFO_LLADDR(&children[index].addr);
       LOG_INFO("\n");
       LOG_INFO("From: ");
-      LOG_INFO_LLADDR(&new_child.from);
+      LOG_INFO_LLADDR(&children[index].from);
       LOG_INFO("\n");
-      LOG_INFO("New child of multicast_group %u\n", new_child.multicast_group);
-      
-      // gestion of barns if the received address is a sub-gateway
-      if (linkaddr_cmp(&new_child.addr, &new_child.from)){
-        uint8_t found = 0;
-        for (int i = 0; i < *barns_size; i++) {
-          if (linkaddr_cmp(&barns[i], src)) {
-            found = i+1;
-            break;
-          }
-        }
-        if (found){
-          LOG_INFO("barn already exists, barn number = %u\n", found-1);
-        } else {
-          LOG_INFO("New barn added, barn number = %u\n", *barns_size);
-          *barns_size += 1;
-          barns[*barns_size - 1] = *src;
-        }
-      }
+      LOG_INFO("New child of multicast_group %u\n", children[index].multicast_group);
+      return;
+    }
+
+    if (header.response_type == ROUTE_UPDATE) {
+      process_route_update(data, len, src);
       return;
     }
 
     if (header.response_type == SETUP) {
-      LOG_INFO("Sending back a control packet\n");
-      control_packet_send(GATEWAY, src, RESPONSE, 0, NULL);
+      LOG_INFO("Sub-gateway looking for a parent\n");
+      trickle_reset();
       return;
     }
   }
 
   if (*packet_type == DATA) {
     LOG_INFO("Received data packet\n");
-    linkaddr_t nexthop;
-    get_children(src, &nexthop);
-    if (linkaddr_cmp(&nexthop, NULL)) {
-      LOG_INFO("No children found\n");
+    const uint8_t* head = data;
+    uint16_t len_data;
+    if (len < LEN_DATA_HEADER) {
+      return;
+    }
+    if (head[1] != TOPIC_AGGREGATE) {
+      send_data_ack(src, head[2]);
       return;
     }
 
-    control_packet_send(GATEWAY, &nexthop, DATA_ACK, sizeof(linkaddr_t), src);
+    /* Every node of an aggregate gets its own ack */
+    memcpy(&len_data, head + 3, sizeof(uint16_t));
+    if (len_data > len - LEN_DATA_HEADER || len_data > FRAME_MTU) {
+      return;
+    }
+    /* Copied, a full batch of acks is sent right away and overwrites the packet buffer */
+    uint8_t* records = frame_acquire();
+    if (records == NULL) {
+      return;
+    }
+    memcpy(records, head + LEN_DATA_HEADER, len_data);
+    aggregate_record_t record;
+    uint16_t offset = 0;
+    while (aggregate_next(records, len_data, &offset, &record) == 0) {
+      send_data_ack(&record.origin, record.seq);
+    }
+    frame_release(records);
   }
 }
 
 
 void process_mobile_packet(const void *data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type, parent_t* parent) {
-  if (len == 0) {
+  uint8_t len_header = packet_header_len(data, len);
+  if (len_header == 0 || len <= len_header) {
     LOG_INFO("Empty packet\n");
     return;
   }
 
-  const void* data_strip = data + sizeof(linkaddr_t) * 2;
+  const void* data_strip = data + len_header;
+  uint16_t len_strip = len - len_header;
 
   uint8_t head = ((uint8_t *)data_strip)[0];
   *packet_type = head >> 7;
@@ -763,8 +3117,13 @@ void process_mobile_packet(const void *data, uint16_t len, linkaddr_t *src, link
     LOG_INFO("Response type: %u\n", header.response_type);
 
 
-    if (header.node_type == SUB_GATEWAY && header.response_type == RESPONSE) {
-      check_parent_node(src, header.node_type, parent, UNICAST_GROUP);
+    uint8_t hops;
+    uint16_t rank;
+    if (
+      header.node_type == SUB_GATEWAY && header.response_type == RESPONSE &&
+      process_rank(data_strip, len_strip, &hops, &rank) == 0
+    ) {
+      check_parent_node(src, header.node_type, hops, rank, parent, UNICAST_GROUP);
       return;
     }
 
@@ -780,16 +3139,21 @@ void process_mobile_packet(const void *data, uint16_t len, linkaddr_t *src, link
 
     if (header.response_type == RESPONSE) {
       LOG_INFO("Received response control packet\n");
-      check_parent_node(src, header.node_type, parent, UNICAST_GROUP);
+      if (process_rank(data_strip, len_strip, &hops, &rank) == 0) {
+        check_parent_node(src, header.node_type, hops, rank, parent, UNICAST_GROUP);
+      }
       return;
     }
 
     if (header.response_type == SETUP_ACK) {
-      set_child(src, (uint8_t*)data_strip);
-      child_t new_child = children[children_count - 1];
+      int index = set_child(src, data_strip, len_strip);
+      if (index == -1) {
+        return;
+      }
+      child_t new_child = children[index];
 
       /* Forwarding child to gateway */
-      send_child(new_child, NODE, parent);
+      send_child(new_child);
 
       LOG_INFO("Received setup ack control packet new children at address: ");
       LOG_INFO_LLADDR(&new_child.addr);
@@ -798,7 +3162,7 @@ void process_mobile_packet(const void *data, uint16_t len, linkaddr_t *src, link
     }
 
     if (header.response_type == DATA_ACK) {
-      process_data_ack(data_strip, src);
+      process_data_ack(data_strip, len_strip, src);
       return;
     }
 
@@ -811,9 +3175,10 @@ void process_mobile_packet(const void *data, uint16_t len, linkaddr_t *src, link
   }
 
   if (*packet_type == DATA) {
-    data_packet_t data_packet;
-    process_data_packet(data, len, &data_packet);
-    print_data_packet(&data_packet);
+    data_packet_view_t data_view;
+    if (process_data_view(data, len, &data_view) == 0) {
+      print_data_view(&data_view);
+    }
     return;
   }
 }
@@ -831,11 +3196,24 @@ void print_data_packet(data_packet_t* data_packet) {
   LOG_INFO("Data packet\n");
   LOG_INFO("Type: %u\n", data_packet->header.type);
   LOG_INFO("Up: %u\n", data_packet->header.up);
-  LOG_INFO("Length of topic: %u\n", data_packet->header.len_topic);
+  LOG_INFO("Topic: %u\n", data_packet->header.topic);
+  LOG_INFO("Seq: %u\n", data_packet->header.seq);
   LOG_INFO("Length of data: %u\n", data_packet->header.len_data);
-  LOG_INFO("Topic: %s\n", data_packet->topic);
   LOG_INFO("Mobile flags: %u\n", data_packet->header.mobile_flags);
-  LOG_INFO("Data: %s\n", data_packet->data);
+  LOG_INFO("Length of payload: %u\n", data_packet->header.len_data);
+}
+
+void print_data_view(const data_packet_view_t* view) {
+  LOG_INFO("Data packet\n");
+  LOG_INFO("Type: %u\n", view->header.type);
+  LOG_INFO("Up: %u\n", view->header.up);
+  LOG_INFO("Topic: %u\n", view->header.topic);
+  LOG_INFO("Seq: %u\n", view->header.seq);
+  LOG_INFO("Length of data: %u\n", view->header.len_data);
+  LOG_INFO("Mobile flags: %u\n", view->header.mobile_flags);
+  char text[32];
+  tlv_render(view->data, view->header.len_data, text, sizeof(text));
+  LOG_INFO("Data: %s\n", text);
 }
 
 void print_control_packet(control_packet_t* control_packet) {
@@ -846,9 +3224,54 @@ void print_control_packet(control_packet_t* control_packet) {
   LOG_INFO("Data: %p\n", control_packet->data);
 }
 
+void print_frame_pool_stats() {
+  LOG_INFO("Frame pool: %u in use, high water %u/%u, %u failures\n",
+    pool_stats.in_use, pool_stats.high_water, FRAME_POOL_SIZE, pool_stats.failures);
+}
+
+void print_ack_stats() {
+  for (uint8_t i = 0; i < ACK_WINDOWS; i++) {
+    if (!ack_windows[i].used) {
+      continue;
+    }
+    LOG_INFO("Data sent to ");
+    LOG_INFO_LLADDR(&ack_windows[i].dest);
+    LOG_INFO_(": %u sent, %u acked, %u lost, %u retransmitted, %u outstanding\n",
+      ack_windows[i].stats.sent, ack_windows[i].stats.acked, ack_windows[i].stats.lost,
+      ack_windows[i].stats.retransmissions, ack_windows[i].stats.outstanding);
+  }
+}
+
+void print_tx_queue_stats() {
+  for (uint8_t i = 0; i < TX_CLASSES; i++) {
+    LOG_INFO("TX class %u: %u queued (max %u), %u sent, %u dropped\n",
+      i, tx_stats.depth[i], tx_stats.high_water[i], tx_stats.sent[i], tx_stats.drops[i]);
+  }
+}
+
+void print_link_estimates() {
+  link_estimate_t estimate;
+  for (uint8_t i = 0; i < LINK_NEIGHBORS; i++) {
+    if (!links[i].used || link_estimate(&links[i].addr, &estimate) == -1) {
+      continue;
+    }
+    LOG_INFO("Link to ");
+    LOG_INFO_LLADDR(&links[i].addr);
+    LOG_INFO_(": rssi %d, lqi %u, etx %u/%u over %u acks, cost %u\n",
+      estimate.rssi, estimate.lqi, estimate.etx, LINK_ETX_DIVISOR, estimate.etx_samples, estimate.cost);
+  }
+}
+
+void print_dup_stats() {
+  LOG_INFO("Duplicates: %u dropped, %u first seen\n", dup_stats.hits, dup_stats.misses);
+}
+
 void print_children() {
   LOG_INFO("Children\n");
-  for (uint8_t i = 0; i < children_count; i++) {
+  for (uint16_t i = 0; i < CHILDREN_TABLE_SIZE; i++) {
+    if (!children_used[i]) {
+      continue;
+    }
     LOG_INFO("Child %u\n", i);
     LOG_INFO("Address: ");
     LOG_INFO_LLADDR(&children[i].addr);
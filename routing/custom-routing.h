@@ -3,10 +3,14 @@
 #include "contiki.h"
 #include "net/netstack.h"
 #include "net/nullnet/nullnet.h"
+#include "net/packetbuf.h"
 #include <string.h>
 #include <stdio.h> /* For printf() */
 #include <stdlib.h>
 #include "dev/cc2420.h"
+#include "lib/random.h"
+#include "lib/crc16.h"
+#include "cfs/cfs.h"
 #include "sys/log.h"
 
 /* TYPE */
@@ -25,6 +29,12 @@
 #define SETUP_ACK 0b010
 #define DATA_ACK 0b011
 #define CHILD_RM 0b100
+#define FRAGMENT 0b101
+#define ROUTE_UPDATE 0b110
+
+/* Route update operations */
+#define ROUTE_REMOVE 0
+#define ROUTE_ADD 1
 
 /* Mobile flags*/
 #define NOT_MOBILE 0b00
@@ -38,6 +48,19 @@
 
 */
 
+/* 
+    Compressed packet structure (COMPRESS_HEADER):
+    [ src (1, 2 or 9 bytes) ]
+    [packet] 
+
+    The dest is always the MAC destination and is not sent.
+    Every address (src, data dest, control payloads) is encoded as:
+    [1 (1b)] [ u8[1] (7b) ] [ u8[0] (8b) ]   short address, u8[2..7] are 0
+    [ 0x00 ] [ linkaddr ]                     full address
+    [ 0x01 ]                                  same as the MAC source, only for the src
+
+*/
+
 /* 
     Control packet structure:
     [ src ] [ dest ] 
@@ -46,30 +69,447 @@
 
 */
 
+/* 
+    Fragment structure (control packet, response type FRAGMENT):
+    [ src ] [ dest ] 
+    [type (1b)] [node_type (2b)] [response_type (3b)] [ empty (2b) ] 
+    [tag (8b)] [offset (16b)] [total (16b)]
+    [slice of the datagram]
+
+    A datagram is a whole packet, from its src to its data, too large
+    for FRAME_MTU. It is split and reassembled at every hop.
+
+*/
+
+/* 
+    Response structure (control packet, response type RESPONSE):
+    [type (1b)] [node_type (2b)] [response_type (3b)] [ empty (2b) ] 
+    [hops (8b)] [rank (16b)]
+
+    hops is the number of links to the gateway, rank the path cost to it,
+    big endian, the sum of the per hop costs (ETX guessed from the RSSI and
+    LQI, times LINK_ETX_DIVISOR) along the way. The gateway advertises 0 and 0.
+
+*/
+
+/* 
+    Route update structure (control packet, response type ROUTE_UPDATE):
+    [type (1b)] [node_type (2b)] [response_type (3b)] [ empty (2b) ] 
+    [op (1b)] [ empty (3b)] [multicast group (4b)] [ child (encoded address) ]
+    ...
+
+    Sent to the parent, the changes of the children table below the
+    sender. op is ROUTE_ADD for a child joining or moving under the
+    sender, the parent adds it and passes it up. op is ROUTE_REMOVE for
+    a child whose lease ran out, the parent drops it too if it reaches
+    it through the sender, and so on up. Changes are collected for
+    ROUTE_UPDATE_WINDOW or until the frame is full.
+
+*/
+
+/* 
+    Checkpoint structure (file CHECKPOINT_FILE):
+    [version (8b)] [node_type (8b)] [has parent (8b)]
+    [ parent (encoded address) ] [parent type (8b)] [joined as (8b)]
+    [multicast group (8b)] [hops (8b)] [rank (16b)]       if has parent
+    [children (16b)]
+    [direct (1b)] [ empty (3b)] [multicast group (4b)] [ child (encoded address) ]
+    [ next hop (encoded address) ]                         if not direct
+    ...
+    [crc16 (16b)]
+
+    direct is 1 when the child is its own next hop. The file is rewritten
+    whole, CHECKPOINT_DELAY after the first change since the last write,
+    and only if its crc changed. Its 16 bit fields are in host order, the
+    file never leaves the node.
+
+*/
+
 /* 
     Data packet structure:
     [ src ] [ dest ] 
     [type (1b)] [ up (1b) ] [ multicast group (4b) ] [ Mobile comm (2b) ]
-    [len_topic (16b)] [len_data (16b)] 
+    [topic (8b)] [seq (8b)] [len_data (16b)] 
     [ dest (sizeof(linkaddr) or 0) ]
-    [topic] [data] 
+    [data] 
 
     If up is 1, the packet is going up the tree
     and the dest field is empty
 
+    seq is 0 when no ack is requested, otherwise it is counted per
+    destination and echoed by a DATA_ACK, which lists the acks going
+    through the same next hop:
+    [type (1b)] [node_type (2b)] [response_type (3b)] [ empty (2b) ] 
+    [ acked node (encoded address) ] [seq (8b)]
+    ...
+
+*/
+
+/* 
+    Aggregate payload structure (TOPIC_AGGREGATE), a list of records:
+    [origin (encoded address)] [topic (8b)] [seq (8b)] [len_data (8b)] [data]
+    ...
+
+*/
+
+/* 
+    Data payload structure, a list of typed values:
+    [value type (8b)] [len (8b)] [value (len bytes, big endian)]
+    ...
+
 */
 
-#define LEN_HEADER 2*sizeof(linkaddr_t)
-#define LEN_CONTROL_HEADER sizeof(uint8_t)
-#define LEN_DATA_HEADER sizeof(uint8_t) + 2*sizeof(uint16_t)
+/* Compressed header mode, short addresses and elided MAC fields, all the nodes must agree on it */
+#ifdef ROUTING_CONF_COMPRESS_HEADER
+#define COMPRESS_HEADER ROUTING_CONF_COMPRESS_HEADER
+#else
+#define COMPRESS_HEADER 0
+#endif
+
+#define ADDR_FULL 0x00
+#define ADDR_ELIDED 0x01
+#define ADDR_SHORT 0x80
+
+/* Maximum length of an encoded address and of the src and dest header.
+   LINKADDR_SIZE rather than sizeof, the size checks below need them in #if */
+#if COMPRESS_HEADER
+#define LEN_ADDR (LINKADDR_SIZE + 1)
+#define LEN_HEADER LEN_ADDR
+#else
+#define LEN_ADDR LINKADDR_SIZE
+#define LEN_HEADER (2*LINKADDR_SIZE)
+#endif
+#define LEN_CONTROL_HEADER 1
+#define LEN_DATA_HEADER (3*sizeof(uint8_t) + sizeof(uint16_t))
+
+/* Largest frame given to nullnet, 127 bytes minus the MAC header and the FCS */
+#ifdef ROUTING_CONF_FRAME_MTU
+#define FRAME_MTU ROUTING_CONF_FRAME_MTU
+#else
+#define FRAME_MTU 104
+#endif
+
+/* Number of frames waiting for the radio, a datagram of DATAGRAM_MTU bytes takes 4 */
+#ifdef ROUTING_CONF_TX_QUEUE_SIZE
+#define TX_QUEUE_SIZE ROUTING_CONF_TX_QUEUE_SIZE
+#else
+#define TX_QUEUE_SIZE 6
+#endif
+
+/* Number of frame buffers in the static pool used by the send paths. The
+   TX queue holds pool frames, so by default a full queue still leaves the
+   two frames a send path builds with at most */
+#ifdef ROUTING_CONF_FRAME_POOL_SIZE
+#define FRAME_POOL_SIZE ROUTING_CONF_FRAME_POOL_SIZE
+#else
+#define FRAME_POOL_SIZE (TX_QUEUE_SIZE + 2)
+#endif
+
+/* TX CLASSES, in priority order, a full queue drops the lowest first */
+#define TX_CONTROL 0
+#define TX_COMMAND 1
+#define TX_TELEMETRY 2
+#define TX_KEEP_ALIVE 3
+#define TX_CLASSES 4
+
+/* Largest packet sent in fragments, every reassembly buffer is this large */
+#ifdef ROUTING_CONF_DATAGRAM_MTU
+#define DATAGRAM_MTU ROUTING_CONF_DATAGRAM_MTU
+#else
+#define DATAGRAM_MTU 256
+#endif
+
+/* Number of datagrams reassembled at the same time */
+#ifdef ROUTING_CONF_REASSEMBLY_BUFFERS
+#define REASSEMBLY_BUFFERS ROUTING_CONF_REASSEMBLY_BUFFERS
+#else
+#define REASSEMBLY_BUFFERS 2
+#endif
+
+/* A datagram still missing fragments after this time is dropped */
+#ifdef ROUTING_CONF_REASSEMBLY_TIMEOUT
+#define REASSEMBLY_TIMEOUT ROUTING_CONF_REASSEMBLY_TIMEOUT
+#else
+#define REASSEMBLY_TIMEOUT (4 * CLOCK_SECOND)
+#endif
+
+/* Fragment header, tag then offset and total on 16 bits */
+#define LEN_FRAGMENT_HEADER 5
+#define FRAGMENT_PAYLOAD (FRAME_MTU - LEN_HEADER - LEN_CONTROL_HEADER - LEN_FRAGMENT_HEADER)
+
+/* The reassembly keeps the fragments received in a 32 bit mask */
+#if (DATAGRAM_MTU + FRAGMENT_PAYLOAD - 1) / FRAGMENT_PAYLOAD > 32
+#error "DATAGRAM_MTU takes more than 32 fragments of FRAGMENT_PAYLOAD bytes"
+#endif
+
+/* TOPICS, only the gateway turns them back into names for the serial line */
+#define TOPIC_UNKNOWN 0
+#define TOPIC_KEEP_ALIVE 1
+#define TOPIC_LIGHT 2
+#define TOPIC_LIGHTS 3
+#define TOPIC_IRRIGATION 4
+#define TOPIC_ACK_IRRIGATION 5
+#define TOPIC_MOBILE 6
+#define TOPIC_AGGREGATE 7 /* records of several nodes, packed by a sub-gateway */
+
+/* Time the sub-gateways hold upward data to send it in a single frame, 0 to forward it right away */
+#ifdef ROUTING_CONF_AGGREGATE_WINDOW
+#define AGGREGATE_WINDOW ROUTING_CONF_AGGREGATE_WINDOW
+#else
+#define AGGREGATE_WINDOW CLOCK_SECOND
+#endif
+
+#define LEN_RECORD_HEADER 3*sizeof(uint8_t)
+#define AGGREGATE_MAX (FRAME_MTU - LEN_HEADER - LEN_DATA_HEADER)
+
+/* VALUE TYPES */
+#define VALUE_U8 1
+#define VALUE_U16 2
+#define VALUE_I16 3
+#define VALUE_FIXED 4 /* signed Q8.8 fixed point */
+#define VALUE_BOOL 5
+#define VALUE_DURATION 6 /* seconds */
+#define VALUE_STRING 7
+
+#define LEN_VALUE_HEADER 2*sizeof(uint8_t)
 
 #define UNICAST_GROUP 0b0000
 #define LIGHT_BULB_GROUP 0b0001
 #define IRRIGATION_GROUP 0b0010
 #define LIGHT_SENSOR_GROUP 0b0011
+#define MULTICAST_GROUPS 16
 
+/* Rejoin after this many consecutive packets without ack */
 #define UNACK_TRESH 2
 
+/* Number of outstanding sequence numbers kept per destination,
+   a packet not acked after this many newer ones is counted as lost */
+#ifdef ROUTING_CONF_ACK_WINDOW
+#define ACK_WINDOW ROUTING_CONF_ACK_WINDOW
+#else
+#define ACK_WINDOW 8
+#endif
+
+/* Number of packets waiting for an ack that can be retransmitted */
+#ifdef ROUTING_CONF_RETX_QUEUE_SIZE
+#define RETX_QUEUE_SIZE ROUTING_CONF_RETX_QUEUE_SIZE
+#else
+#define RETX_QUEUE_SIZE 4
+#endif
+
+/* Number of retransmissions before giving up on a packet */
+#ifdef ROUTING_CONF_RETX_MAX_TRIES
+#define RETX_MAX_TRIES ROUTING_CONF_RETX_MAX_TRIES
+#else
+#define RETX_MAX_TRIES 3
+#endif
+
+/* Time before the first retransmission, doubled after every try, plus up to half of it as jitter */
+#ifdef ROUTING_CONF_RETX_INTERVAL
+#define RETX_INTERVAL ROUTING_CONF_RETX_INTERVAL
+#else
+#define RETX_INTERVAL (2 * CLOCK_SECOND)
+#endif
+
+/* Time the gateway collects the acks going through the same next hop to send them together */
+#ifdef ROUTING_CONF_ACK_BATCH_WINDOW
+#define ACK_BATCH_WINDOW ROUTING_CONF_ACK_BATCH_WINDOW
+#else
+#define ACK_BATCH_WINDOW (CLOCK_SECOND / 2)
+#endif
+
+/* Number of next hops with acks being collected at the same time */
+#ifdef ROUTING_CONF_ACK_BATCHES
+#define ACK_BATCHES ROUTING_CONF_ACK_BATCHES
+#else
+#define ACK_BATCHES 4
+#endif
+
+#define ACK_BATCH_MAX (FRAME_MTU - LEN_HEADER - LEN_CONTROL_HEADER)
+
+/* Number of (origin, seq) kept to drop the data seen twice */
+#ifdef ROUTING_CONF_DUP_CACHE_SIZE
+#define DUP_CACHE_SIZE ROUTING_CONF_DUP_CACHE_SIZE
+#else
+#define DUP_CACHE_SIZE 16
+#endif
+
+/* A forwarder only drops copies closer than a retransmission,
+   a node retransmitting because its ack was lost must get a new one */
+#ifdef ROUTING_CONF_DUP_FORWARD_LIFETIME
+#define DUP_FORWARD_LIFETIME ROUTING_CONF_DUP_FORWARD_LIFETIME
+#else
+#define DUP_FORWARD_LIFETIME CLOCK_SECOND
+#endif
+
+/* The gateway never prints the same data twice in this time */
+#ifdef ROUTING_CONF_DUP_GATEWAY_LIFETIME
+#define DUP_GATEWAY_LIFETIME ROUTING_CONF_DUP_GATEWAY_LIFETIME
+#else
+#define DUP_GATEWAY_LIFETIME (60 * CLOCK_SECOND)
+#endif
+
+/* Time without ack from the parent before an explicit keep alive, doubled after every
+   keep alive acked up to KEEP_ALIVE_MAX and back to KEEP_ALIVE_MIN when one is not */
+#ifdef ROUTING_CONF_KEEP_ALIVE_MIN
+#define KEEP_ALIVE_MIN ROUTING_CONF_KEEP_ALIVE_MIN
+#else
+#define KEEP_ALIVE_MIN (30 * CLOCK_SECOND)
+#endif
+
+#ifdef ROUTING_CONF_KEEP_ALIVE_MAX
+#define KEEP_ALIVE_MAX ROUTING_CONF_KEEP_ALIVE_MAX
+#else
+#define KEEP_ALIVE_MAX (240 * CLOCK_SECOND)
+#endif
+
+/* Number of destinations with an ack window */
+#ifdef ROUTING_CONF_ACK_WINDOWS
+#define ACK_WINDOWS ROUTING_CONF_ACK_WINDOWS
+#else
+#define ACK_WINDOWS 4
+#endif
+
+/* A child not heard from, itself or its subtree, for this long is dropped,
+   longer than two of the longest keep alive intervals */
+#ifdef ROUTING_CONF_CHILD_LEASE
+#define CHILD_LEASE ROUTING_CONF_CHILD_LEASE
+#else
+#define CHILD_LEASE (2 * KEEP_ALIVE_MAX + 2 * KEEP_ALIVE_MIN)
+#endif
+
+/* Number of slots of the lease timer wheel, leases end up to CHILD_LEASE / (CHILD_LEASE_SLOTS - 1) late */
+#ifdef ROUTING_CONF_CHILD_LEASE_SLOTS
+#define CHILD_LEASE_SLOTS ROUTING_CONF_CHILD_LEASE_SLOTS
+#else
+#define CHILD_LEASE_SLOTS 8
+#endif
+
+/* Time the route changes are collected to go up in a single ROUTE_UPDATE, 0 sends them at once */
+#ifdef ROUTING_CONF_ROUTE_UPDATE_WINDOW
+#define ROUTE_UPDATE_WINDOW ROUTING_CONF_ROUTE_UPDATE_WINDOW
+#else
+#define ROUTE_UPDATE_WINDOW (CLOCK_SECOND / 4)
+#endif
+
+#define ROUTE_UPDATE_MAX (FRAME_MTU - LEN_HEADER - LEN_CONTROL_HEADER)
+
+/* Parent and children saved to flash to come back after a reboot without a new SETUP, 0 disables it */
+#ifdef ROUTING_CONF_CHECKPOINT
+#define ROUTING_CHECKPOINT ROUTING_CONF_CHECKPOINT
+#else
+#define ROUTING_CHECKPOINT 1
+#endif
+
+/* Changes of the parent and children in this time go to flash in a single write */
+#ifdef ROUTING_CONF_CHECKPOINT_DELAY
+#define CHECKPOINT_DELAY ROUTING_CONF_CHECKPOINT_DELAY
+#else
+#define CHECKPOINT_DELAY (60 * CLOCK_SECOND)
+#endif
+
+/* A restored parent not acking the probe in this time is given up for a new SETUP */
+#ifdef ROUTING_CONF_RESTORE_PROBE_TIMEOUT
+#define RESTORE_PROBE_TIMEOUT ROUTING_CONF_RESTORE_PROBE_TIMEOUT
+#else
+#define RESTORE_PROBE_TIMEOUT (16 * CLOCK_SECOND)
+#endif
+
+#define CHECKPOINT_FILE "routing"
+#define CHECKPOINT_VERSION 2
+
+/* Discovery beacons follow a Trickle timer (RFC 6206), SETUP while looking for a parent and
+   RESPONSE after, from TRICKLE_IMIN up to TRICKLE_IMIN << TRICKLE_DOUBLINGS between them */
+#ifdef ROUTING_CONF_TRICKLE_IMIN
+#define TRICKLE_IMIN ROUTING_CONF_TRICKLE_IMIN
+#else
+#define TRICKLE_IMIN CLOCK_SECOND
+#endif
+
+#ifdef ROUTING_CONF_TRICKLE_DOUBLINGS
+#define TRICKLE_DOUBLINGS ROUTING_CONF_TRICKLE_DOUBLINGS
+#else
+#define TRICKLE_DOUBLINGS 7
+#endif
+
+#define TRICKLE_IMAX (TRICKLE_IMIN << TRICKLE_DOUBLINGS)
+
+/* Longest interval between the SETUP of a node without a parent, the fixed period it had before Trickle */
+#ifdef ROUTING_CONF_TRICKLE_SETUP_IMAX
+#define TRICKLE_SETUP_IMAX ROUTING_CONF_TRICKLE_SETUP_IMAX
+#else
+#define TRICKLE_SETUP_IMAX (8 * CLOCK_SECOND)
+#endif
+
+/* A RESPONSE beacon is not sent when this many of the same node type were heard in the interval */
+#ifdef ROUTING_CONF_TRICKLE_K
+#define TRICKLE_K ROUTING_CONF_TRICKLE_K
+#else
+#define TRICKLE_K 2
+#endif
+
+/* Longest random delay of a RESPONSE beacon after its Trickle time, less than TRICKLE_IMIN / 2 */
+#ifdef ROUTING_CONF_RESPONSE_JITTER
+#define RESPONSE_JITTER ROUTING_CONF_RESPONSE_JITTER
+#else
+#define RESPONSE_JITTER (CLOCK_SECOND / 8)
+#endif
+
+/* Number of neighbours with a link estimate */
+#ifdef ROUTING_CONF_LINK_NEIGHBORS
+#define LINK_NEIGHBORS ROUTING_CONF_LINK_NEIGHBORS
+#else
+#define LINK_NEIGHBORS 8
+#endif
+
+/* ETX values are fixed point, a packet acked at the first try is LINK_ETX_DIVISOR */
+#define LINK_ETX_DIVISOR 128
+/* ETX sample of a packet never acked */
+#define LINK_ETX_LOSS (2 * (RETX_MAX_TRIES + 1))
+
+/* A parent is replaced only by a path cheaper by this much, in ETX */
+#ifdef ROUTING_CONF_PARENT_SWITCH_HYSTERESIS
+#define PARENT_SWITCH_HYSTERESIS ROUTING_CONF_PARENT_SWITCH_HYSTERESIS
+#else
+#define PARENT_SWITCH_HYSTERESIS (LINK_ETX_DIVISOR / 2)
+#endif
+
+/* Rank of a node without a path to the gateway */
+#define RANK_INFINITE 0xFFFF
+
+/* Parents this many hops away from the gateway or more are never joined */
+#ifdef ROUTING_CONF_RANK_MAX_HOPS
+#define RANK_MAX_HOPS ROUTING_CONF_RANK_MAX_HOPS
+#else
+#define RANK_MAX_HOPS 16
+#endif
+
+/* Number of candidate parents kept, the current one included, to switch without a new SETUP */
+#ifdef ROUTING_CONF_BACKUP_PARENTS
+#define BACKUP_PARENTS ROUTING_CONF_BACKUP_PARENTS
+#else
+#define BACKUP_PARENTS 3
+#endif
+
+/* Size of the children routing table, must be a power of two. The gateway
+   keeps every routed device in it, so it bounds the devices it can address */
+#ifdef ROUTING_CONF_CHILDREN_TABLE_SIZE
+#define CHILDREN_TABLE_SIZE ROUTING_CONF_CHILDREN_TABLE_SIZE
+#else
+#define CHILDREN_TABLE_SIZE 64
+#endif
+
+/* The table is never filled over 3/4 to keep the probe sequences short */
+#define MAX_CHILDREN (CHILDREN_TABLE_SIZE - CHILDREN_TABLE_SIZE / 4)
+
+/* Maximum number of distinct next hops (direct neighbours) of the children,
+   by default every child can be a direct one */
+#ifdef ROUTING_CONF_MAX_NEXTHOPS
+#define MAX_NEXTHOPS ROUTING_CONF_MAX_NEXTHOPS
+#else
+#define MAX_NEXTHOPS MAX_CHILDREN
+#endif
+
 typedef struct {
     linkaddr_t addr;
     linkaddr_t from;
@@ -111,14 +551,16 @@ typedef struct {
 } control_packet_t;
 
 /* Structure for data headers
-    - len_topic: length of the topic
+    - topic: topic code of the data
+    - seq: sequence number, 0 if no ack is requested
     - len_data: length of the data
 */
 typedef struct {
     uint8_t type;
     uint8_t up;
     uint8_t multicast_group;
-    uint16_t len_topic;
+    uint8_t topic;
+    uint8_t seq;
     uint16_t len_data;
     uint8_t mobile_flags;
     linkaddr_t dest;
@@ -126,15 +568,61 @@ typedef struct {
 
 /* Structure for data packets
     - header: control header
-    - topic: topic of the data
     - data: data of the packet
 */
 typedef struct {
     data_header_t header;
-    char* topic;
-    char* data;
+    uint8_t* data;
 } data_packet_t;
 
+/* Structure for data packet views, parsed in place without any copy
+    - header: data header
+    - data: data of the packet, points into the frame, NOT null terminated
+    /!\ Only valid as long as the frame is, the packet buffer
+        is overwritten as soon as a packet is sent
+*/
+typedef struct {
+    data_header_t header;
+    const uint8_t* data;
+} data_packet_view_t;
+
+/* Structure for typed values of a payload
+    - type: type of the value
+    - len: length of the value
+    - value: value bytes, points into the payload
+*/
+typedef struct {
+    uint8_t type;
+    uint8_t len;
+    const uint8_t* value;
+} tlv_t;
+
+/* Structure to encode typed values into a payload
+    - buf: payload buffer
+    - size: size of the buffer
+    - len: length written so far
+*/
+typedef struct {
+    uint8_t* buf;
+    uint16_t size;
+    uint16_t len;
+} tlv_writer_t;
+
+/* Structure for the records of an aggregate payload
+    - origin: address of the node that sent the data
+    - topic: topic code of the data
+    - seq: sequence number of the data, to ack it
+    - len_data: length of the data
+    - data: data of the record, points into the payload
+*/
+typedef struct {
+    linkaddr_t origin;
+    uint8_t topic;
+    uint8_t seq;
+    uint8_t len_data;
+    const uint8_t* data;
+} aggregate_record_t;
+
 typedef struct {
     linkaddr_t src;
     linkaddr_t dest;
@@ -142,6 +630,84 @@ typedef struct {
 } packet_t;
 
 
+/* Statistics of the acks of a destination
+    - sent: number of packets sent with an ack requested
+    - acked: number of them acked, late acks included
+    - lost: number of them still not acked after ACK_WINDOW newer ones
+    - retransmissions: number of retransmissions
+    - outstanding: number of them waiting for an ack
+*/
+typedef struct {
+    uint16_t sent;
+    uint16_t acked;
+    uint16_t lost;
+    uint16_t retransmissions;
+    uint8_t outstanding;
+} ack_stats_t;
+
+/* Called when a packet is still not acked after RETX_MAX_TRIES retransmissions
+    - dest: next hop the packet was sent to
+    - topic: topic code of the packet
+    - seq: sequence number of the packet
+*/
+typedef void (*retx_give_up_callback_t)(const linkaddr_t* dest, uint8_t topic, uint8_t seq);
+
+/* Called when the children table changes
+    - child: child added, moved to another next hop or removed
+    - added: 1 if it was added or moved, 0 if it was removed
+*/
+typedef void (*child_callback_t)(const child_t* child, uint8_t added);
+
+/* Statistics of the duplicate cache
+    - hits: number of duplicates dropped
+    - misses: number of sequenced data seen for the first time
+*/
+typedef struct {
+    uint16_t hits;
+    uint16_t misses;
+} dup_stats_t;
+
+/* Statistics of the transmit queue, per TX class
+    - depth: number of frames currently queued
+    - high_water: maximum number of frames queued at the same time
+    - sent: number of frames given to the radio
+    - drops: number of frames dropped, or evicted, because the queue was full
+*/
+typedef struct {
+    uint8_t depth[TX_CLASSES];
+    uint8_t high_water[TX_CLASSES];
+    uint16_t sent[TX_CLASSES];
+    uint16_t drops[TX_CLASSES];
+} tx_queue_stats_t;
+
+/* Link estimate of a neighbour
+    - rssi: average signal strength of its frames, in dBm
+    - lqi: average link quality indicator (correlation) of its frames
+    - etx: average transmissions per acked packet, times LINK_ETX_DIVISOR
+    - etx_samples: number of packets the etx is computed from
+    - cost: etx, or a guess from the rssi and lqi before any ack,
+            used to choose the parent
+*/
+typedef struct {
+    signed char rssi;
+    uint8_t lqi;
+    uint16_t etx;
+    uint8_t etx_samples;
+    uint16_t cost;
+} link_estimate_t;
+
+/* Statistics of the frame pool
+    - in_use: number of frames currently acquired, the queued ones included
+    - high_water: maximum number of frames acquired at the same time
+    - failures: number of acquisitions that failed because the pool was empty
+*/
+typedef struct {
+    uint8_t in_use;
+    uint8_t high_water;
+    uint16_t failures;
+} frame_pool_stats_t;
+
+
 // static parent_t* parent;
 static uint8_t setup = 0;
 // Maybe not needed
@@ -169,26 +735,28 @@ void set_parent(const linkaddr_t* parent_addr, uint8_t type, signed char rssi, p
  * @brief Set the child address
  * 
  * @param src source address
- * @param data data of the packet
+ * @param data control packet, without the src and dest header
+ * @param len length of the control packet
+ * @return int index of the child in the table, -1 if the table is full or the packet malformed
  */
-void set_child(const linkaddr_t* src, uint8_t* data);
+int set_child(const linkaddr_t* src, const uint8_t* data, uint16_t len);
 
 /**
  * @brief Get the children of a node
  * 
  * @param src source address
  * @param nexthop next hop address
+ * @return int index of the child in the table, -1 if not found
  */
 int get_children(const linkaddr_t* src, linkaddr_t* nexthop);
 
 /**
- * @brief Send child to parent
+ * @brief Announce a child to the parent, along with the other route changes
+ *        of the ROUTE_UPDATE_WINDOW
  * 
  * @param child child node
- * @param node_type type of the node
- * @param parent parent node
  */
-void send_child(child_t child, uint8_t node_type, parent_t* parent);
+void send_child(child_t child);
 
 /**
  * @brief Get the multicast children of a node
@@ -214,23 +782,107 @@ void rm_child(linkaddr_t* addr);
 uint8_t not_setup(); 
 
 /**
- * @brief Initialize the node
+ * @brief Start the discovery beacons of a node, does nothing if they already run
  * 
  */
 void init_node();
 
 /**
- * @brief Initialize the gateway
+ * @brief Start the discovery beacons of a sub-gateway, does nothing if they already run
  * 
  */
 void init_sub_gateway();
 
 /**
- * @brief Initialize the gateway
+ * @brief Start the discovery beacons of the gateway, does nothing if they already run
  * 
  */
 void init_gateway();
 
+/**
+ * @brief Start looking for a parent as a mobile node, which never advertises itself
+ * 
+ */
+void init_mobile();
+
+/**
+ * @brief Restore the parent and children saved before a reboot and start the
+ *        discovery beacons, the parent is trusted until it fails to ack a
+ *        probe in RESTORE_PROBE_TIMEOUT, the node then looks for a new one.
+ *        The probe is a keep alive without payload, which the gateway does
+ *        not print
+ * 
+ * @param parent parent node to fill
+ * @param node_type type of the node, NODE or SUB_GATEWAY
+ * @return int 0 on success, -1 if there is no valid checkpoint for this node type
+ */
+int routing_restore(parent_t* parent, uint8_t node_type);
+
+/**
+ * @brief Acquire a FRAME_MTU bytes frame buffer from the pool
+ * 
+ * @return uint8_t* frame buffer, NULL if the pool is empty
+ */
+uint8_t* frame_acquire();
+
+/**
+ * @brief Give a frame buffer back to the pool
+ * 
+ * @param frame frame buffer returned by frame_acquire
+ */
+void frame_release(uint8_t* frame);
+
+/**
+ * @brief Get the statistics of the frame pool
+ * 
+ * @param stats statistics pointer to fill
+ */
+void frame_pool_stats(frame_pool_stats_t* stats);
+
+/**
+ * @brief Get the statistics of the transmit queue
+ * 
+ * @param stats statistics pointer to fill
+ */
+void tx_queue_stats(tx_queue_stats_t* stats);
+
+/**
+ * @brief Encode an address, short if possible in the compressed mode
+ * 
+ * @param output output buffer, at least LEN_ADDR bytes
+ * @param addr address to encode
+ * @return uint8_t length of the encoded address
+ */
+uint8_t packing_addr(uint8_t* output, const linkaddr_t* addr);
+
+/**
+ * @brief Decode an address written by packing_addr
+ * 
+ * @param input_data encoded address
+ * @param len length available in the input
+ * @param addr address pointer to fill
+ * @return uint8_t length of the encoded address, 0 if it is malformed
+ */
+uint8_t process_addr(const uint8_t* input_data, uint16_t len, linkaddr_t* addr);
+
+/**
+ * @brief Set the function receiving the packets, to use instead of
+ *        nullnet_set_input_callback, fragments are reassembled before it is called
+ * 
+ * @param callback input callback of the application
+ */
+void routing_set_input_callback(nullnet_input_callback callback);
+
+/**
+ * @brief Write the src and dest at the beginning of a frame
+ * 
+ * @param output output frame
+ * @param src source address
+ * @param dest destination address
+ * @return uint8_t length of the header, the packet starts right after it
+ */
+uint8_t packing_header(uint8_t* output, const linkaddr_t* src, const linkaddr_t* dest);
+
 /**
  * @brief Send a packet to a destination
  * 
@@ -239,8 +891,18 @@ void init_gateway();
  * @param dest destination address
  * @param packet packet to send
  * @param len_packet length of the packet
+ * @return uint16_t length of the frame
  */
-void packing_packet(uint8_t* output, linkaddr_t* src, linkaddr_t* dest, uint8_t* packet, uint16_t len_packet);
+uint16_t packing_packet(uint8_t* output, linkaddr_t* src, linkaddr_t* dest, uint8_t* packet, uint16_t len_packet);
+
+/**
+ * @brief Get the length of the src and dest header of a frame
+ * 
+ * @param input_data packet data
+ * @param len packet length
+ * @return uint8_t length of the header, 0 if the frame is too short
+ */
+uint8_t packet_header_len(const uint8_t* input_data, uint16_t len);
 
 /**
  * @brief Process a packet and determine its type
@@ -257,14 +919,13 @@ void process_packet(const uint8_t* input_data, uint16_t len, packet_t* packet);
  * @param data_packet data packet pointer to store the header
  * @param up up flag
  * @param multicast_group multicast group
- * @param len_topic length of the topic
+ * @param topic topic code of the data
  * @param len_data length of the data
- * @param topic topic of the data
  * @param data data of the packet
  * @param dest destination address
  * @param mobile_flags mobile flags
  */
-void build_data_header(data_packet_t* data_packet, uint8_t up, uint8_t multicast_group, uint16_t len_topic, uint16_t len_data, char* topic, char* data, linkaddr_t* dest, uint8_t mobile_flags);
+void build_data_header(data_packet_t* data_packet, uint8_t up, uint8_t multicast_group, uint8_t topic, uint16_t len_data, uint8_t* data, linkaddr_t* dest, uint8_t mobile_flags);
 
 /**
  * @brief Pack the data packet
@@ -275,28 +936,76 @@ void build_data_header(data_packet_t* data_packet, uint8_t up, uint8_t multicast
 void packing_data_packet(data_packet_t* data_packet, uint8_t* data);
 
 /**
- * @brief Process the data header of a packet
+ * @brief Get the length of a packed data packet
+ * 
+ * @param data_packet data packet pointer
+ * @return uint16_t length of the packet without the src and dest header
+ */
+uint16_t get_data_packet_len(data_packet_t* data_packet);
+
+/**
+ * @brief Parse a data packet in place, topic and data point into the input
  * 
  * @param input_data packet data
  * @param len packet length
- * @param data_packet data packet pointer to store the header
+ * @param view view to fill
+ * @return int 0 on success, -1 if the frame is not a valid data packet
  */
-void process_data_packet(const uint8_t *input_data, uint16_t len, data_packet_t* data_packet);
+int process_data_view(const uint8_t* input_data, uint16_t len, data_packet_view_t* view);
 
 /**
  * @brief Send a data packet to the parent node
  * 
  * @param up up flag
  * @param multicast_group multicast group
- * @param len_topic length of the topic
+ * @param topic topic code of the data
  * @param len_data length of the data
- * @param topic topic of the data
  * @param data data of the packet
  * @param dest destination address
  * @param ack ack flag
  * @param mobile_flags mobile flags
  */
-void send_data_packet(uint8_t up, uint8_t multicast_group, uint16_t len_topic, uint16_t len_data, char* topic, char* input_data, linkaddr_t* dest, uint8_t ack, uint8_t mobile_flags);
+void send_data_packet(uint8_t up, uint8_t multicast_group, uint8_t topic, uint16_t len_data, uint8_t* input_data, linkaddr_t* dest, uint8_t ack, uint8_t mobile_flags);
+
+/**
+ * @brief Get the ack statistics of a destination
+ * 
+ * @param dest destination address
+ * @param stats statistics pointer to fill
+ * @return int 0 on success, -1 if nothing was sent to it with an ack
+ */
+int ack_window_stats(const linkaddr_t* dest, ack_stats_t* stats);
+
+/**
+ * @brief Set the function called when a packet sent with an ack is given up
+ * 
+ * @param callback give up callback of the application, NULL for none
+ */
+void routing_set_give_up_callback(retx_give_up_callback_t callback);
+
+/**
+ * @brief Set the function called when a child is added, moved or removed
+ * 
+ * @param callback child callback of the application, NULL for none
+ */
+void routing_set_child_callback(child_callback_t callback);
+
+/**
+ * @brief Check if data was already seen and remember it otherwise
+ * 
+ * @param origin address of the node that sent the data
+ * @param seq sequence number of the data, 0 is never a duplicate
+ * @param lifetime time during which the same data is a duplicate
+ * @return uint8_t 1 if it is a duplicate, 0 otherwise
+ */
+uint8_t is_duplicate(const linkaddr_t* origin, uint8_t seq, clock_time_t lifetime);
+
+/**
+ * @brief Get the statistics of the duplicate cache
+ * 
+ * @param stats statistics pointer to fill
+ */
+void dup_cache_stats(dup_stats_t* stats);
 
 /**
  * @brief Forward a data packet to the parent node
@@ -308,12 +1017,161 @@ void send_data_packet(uint8_t up, uint8_t multicast_group, uint16_t len_topic, u
 void forward_data_packet(const void *data, uint16_t len, parent_t* parent);
 
 /**
- * @brief Send a data packet to the parent node
+ * @brief Send a keep alive packet to the parent node, unless an ack came from it
+ *        in the current keep alive interval, to call every KEEP_ALIVE_MIN
  * 
  * @param parent parent node
  * @param name name of the node
+ * @return uint8_t 1 if the packet was sent, 0 if the recent traffic stood for it
+ */
+uint8_t keep_alive(parent_t* parent, char* name);
+
+/**
+ * @brief Buffer an upward data packet to send it to the parent in an aggregate,
+ *        the aggregate is sent after AGGREGATE_WINDOW or when it is full
+ * 
+ * @param view data packet view, its data is copied
+ * @param origin address of the node that sent the data
+ * @param parent parent node
+ * @return int 0 if buffered, -1 if the packet has to be forwarded as is
+ */
+int aggregate_data_packet(const data_packet_view_t* view, const linkaddr_t* origin, parent_t* parent);
+
+/**
+ * @brief Send the buffered aggregate to the parent now
+ * 
+ * @return int 0 if the buffer is empty after it, -1 if no frame was free and the records are kept
+ */
+int aggregate_flush();
+
+/**
+ * @brief Read the next record of an aggregate payload
+ * 
+ * @param payload payload data
+ * @param len payload length
+ * @param offset offset of the next record, 0 for the first one, updated
+ * @param record record pointer to fill
+ * @return int 0 on success, -1 at the end of the payload or if it is malformed
+ */
+int aggregate_next(const uint8_t* payload, uint16_t len, uint16_t* offset, aggregate_record_t* record);
+
+/**
+ * @brief Get the name of a topic, used at the serial boundary
+ * 
+ * @param topic topic code
+ * @return const char* name of the topic, "unknown" if not registered
+ */
+const char* topic_name(uint8_t topic);
+
+/**
+ * @brief Get the code of a topic from its name
+ * 
+ * @param name null terminated name of the topic
+ * @return uint8_t topic code, TOPIC_UNKNOWN if not registered
+ */
+uint8_t topic_code(const char* name);
+
+/**
+ * @brief Start encoding typed values into a payload buffer
+ * 
+ * @param writer writer to initialize
+ * @param buf payload buffer
+ * @param size size of the buffer
+ */
+void tlv_init(tlv_writer_t* writer, uint8_t* buf, uint16_t size);
+
+/**
+ * @brief Append an unsigned 8 bits value
+ * 
+ * @param writer payload writer
+ * @param value value to append
+ * @return int 0 on success, -1 if the buffer is full
+ */
+int tlv_put_u8(tlv_writer_t* writer, uint8_t value);
+
+/**
+ * @brief Append an unsigned 16 bits value
+ * 
+ * @param writer payload writer
+ * @param value value to append
+ * @return int 0 on success, -1 if the buffer is full
+ */
+int tlv_put_u16(tlv_writer_t* writer, uint16_t value);
+
+/**
+ * @brief Append a signed 16 bits value
+ * 
+ * @param writer payload writer
+ * @param value value to append
+ * @return int 0 on success, -1 if the buffer is full
+ */
+int tlv_put_i16(tlv_writer_t* writer, int16_t value);
+
+/**
+ * @brief Append a signed Q8.8 fixed point value
+ * 
+ * @param writer payload writer
+ * @param value value multiplied by 256
+ * @return int 0 on success, -1 if the buffer is full
+ */
+int tlv_put_fixed(tlv_writer_t* writer, int16_t value);
+
+/**
+ * @brief Append a boolean value
+ * 
+ * @param writer payload writer
+ * @param value value to append
+ * @return int 0 on success, -1 if the buffer is full
+ */
+int tlv_put_bool(tlv_writer_t* writer, uint8_t value);
+
+/**
+ * @brief Append a duration
+ * 
+ * @param writer payload writer
+ * @param seconds duration in seconds
+ * @return int 0 on success, -1 if the buffer is full
  */
-void keep_alive(parent_t* parent, char* name);
+int tlv_put_duration(tlv_writer_t* writer, uint16_t seconds);
+
+/**
+ * @brief Append a string, without its null terminator
+ * 
+ * @param writer payload writer
+ * @param value null terminated string
+ * @return int 0 on success, -1 if the buffer is full
+ */
+int tlv_put_string(tlv_writer_t* writer, const char* value);
+
+/**
+ * @brief Read the next typed value of a payload
+ * 
+ * @param payload payload data
+ * @param len payload length
+ * @param offset offset of the next value, 0 for the first one, updated
+ * @param tlv value pointer to fill
+ * @return int 0 on success, -1 at the end of the payload or if it is malformed
+ */
+int tlv_next(const uint8_t* payload, uint16_t len, uint16_t* offset, tlv_t* tlv);
+
+/**
+ * @brief Get the integer value of a numeric typed value
+ * 
+ * @param tlv typed value
+ * @return int32_t value, Q8.8 raw value for fixed point, 0 for strings
+ */
+int32_t tlv_to_int(const tlv_t* tlv);
+
+/**
+ * @brief Render a payload as text, values separated by '?'
+ * 
+ * @param payload payload data
+ * @param len payload length
+ * @param output text buffer
+ * @param size size of the text buffer
+ * @return uint16_t length of the text, without the null terminator
+ */
+uint16_t tlv_render(const uint8_t* payload, uint16_t len, char* output, uint16_t size);
 
 /**
  * @brief Build the control header of a packet
@@ -355,15 +1213,27 @@ void process_control_header(const uint8_t *data, uint16_t len, control_header_t*
 void control_packet_send(uint8_t node_type, linkaddr_t* dest, uint8_t response_type, uint16_t len_of_data, void* control_data); 
 
 /**
- * @brief Check if the parent node is better than the current one and update it,
- *        only for the nodes
+ * @brief Get the link estimate of a neighbour, updated by every frame received from it
+ *        and by the acks of the packets sent through it
+ * 
+ * @param addr neighbour address
+ * @param estimate estimate pointer to fill
+ * @return int 0 on success, -1 if the neighbour has no estimate
+ */
+int link_estimate(const linkaddr_t* addr, link_estimate_t* estimate);
+
+/**
+ * @brief Check if the parent node offers a cheaper path to the gateway than the
+ *        current one and update it, only for the nodes
  * 
  * @param src source address
  * @param node_type type of the node
+ * @param hops hops of the node to the gateway, from its RESPONSE
+ * @param rank path cost of the node to the gateway, from its RESPONSE
  * @param parent parent node
  * @param multicast_group multicast group
  */
-void check_parent_node(const linkaddr_t* src, uint8_t node_type, parent_t* parent, uint8_t multicast_group);
+void check_parent_node(const linkaddr_t* src, uint8_t node_type, uint8_t hops, uint16_t rank, parent_t* parent, uint8_t multicast_group);
 
 /**
  * @brief Check if the parent node is better than the current one and update it,
@@ -371,9 +1241,11 @@ void check_parent_node(const linkaddr_t* src, uint8_t node_type, parent_t* paren
  * 
  * @param src source address
  * @param node_type type of the node
+ * @param hops hops of the node to the gateway, from its RESPONSE
+ * @param rank path cost of the node to the gateway, from its RESPONSE
  * @param parent parent node
  */
-void check_parent_sub_gateway(const linkaddr_t* src, uint8_t node_type, parent_t* parent);
+void check_parent_sub_gateway(const linkaddr_t* src, uint8_t node_type, uint8_t hops, uint16_t rank, parent_t* parent);
 
 /**
  * @brief Process a packet and determine its type, if it is a control
@@ -401,7 +1273,25 @@ void process_node_packet(const void *data, uint16_t len, linkaddr_t *src, linkad
 void process_sub_gateway_packet(const uint8_t* data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type, parent_t* parent);
 
 
-void process_data_ack(const uint8_t* data, linkaddr_t* src);
+/**
+ * @brief Process the route changes of a subtree, add the children joining
+ *        through the sender, drop the expired ones reached through it and
+ *        pass the changes up to the parent
+ * 
+ * @param data control packet, without the src and dest header
+ * @param len length of the control packet
+ * @param src source address
+ */
+void process_route_update(const uint8_t* data, uint16_t len, linkaddr_t* src);
+
+/**
+ * @brief Process a data ack, consume it or pass it down to the acked node
+ * 
+ * @param data control packet, without the src and dest header
+ * @param len length of the control packet
+ * @param src source address
+ */
+void process_data_ack(const uint8_t* data, uint16_t len, linkaddr_t* src);
 
 /**
  * @brief Process a packet and determine its type, if it is a control
@@ -412,7 +1302,7 @@ void process_data_ack(const uint8_t* data, linkaddr_t* src);
  * @param dest destination address
  * @param packet_type packet type pointer to store the type of the packet
 */
-void process_gateway_packet(const void *data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type, linkaddr_t* barns, int* barns_size);
+void process_gateway_packet(const void *data, uint16_t len, linkaddr_t *src, linkaddr_t *dest, uint8_t* packet_type);
 
 /**
  * @brief Process a packet and determine its type, if it is a control
@@ -435,6 +1325,13 @@ void process_mobile_packet(const void *data, uint16_t len, linkaddr_t *src, link
  */
 void print_data_packet(data_packet_t* data_packet); 
 
+/**
+ * @brief Print a data packet view
+ * 
+ * @param view data packet view to print
+ */
+void print_data_view(const data_packet_view_t* view);
+
 /**
  * @brief Print the control header of a packet
  * 
@@ -447,5 +1344,30 @@ void print_control_header(control_header_t* control_header);
  */
 void print_children();
 
+/**
+ * @brief Print the statistics of the frame pool
+ */
+void print_frame_pool_stats();
+
+/**
+ * @brief Print the statistics of the transmit queue
+ */
+void print_tx_queue_stats();
+
+/**
+ * @brief Print the ack statistics of every destination
+ */
+void print_ack_stats();
+
+/**
+ * @brief Print the statistics of the duplicate cache
+ */
+void print_dup_stats();
+
+/**
+ * @brief Print the link estimate of every neighbour
+ */
+void print_link_estimates();
+
 
 #endif /* CUSTOM_ROUTING_H */
\ No newline at end of file
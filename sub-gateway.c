@@ -75,7 +75,9 @@ PROCESS_THREAD(gateway_process, ev, data)
   PROCESS_BEGIN();
 
   // RESPONSE FUNCTION
-  nullnet_set_input_callback(input_callback);
+  routing_set_input_callback(input_callback);
+  // Parent and children saved before a reboot, if any
+  routing_restore(&parent, SUB_GATEWAY);
   
   etimer_set(&periodic_timer_setup, SEND_INTERVAL);
 
@@ -93,6 +95,10 @@ PROCESS_THREAD(gateway_process, ev, data)
     etimer_reset(&periodic_timer);
     LOG_INFO("Running....\n");
     print_children();
+    print_ack_stats();
+    print_dup_stats();
+    print_tx_queue_stats();
+    print_link_estimates();
     keep_alive(&parent, "sub_gateway");
     PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&periodic_timer));
   }
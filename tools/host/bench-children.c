@@ -0,0 +1,99 @@
+/*
+ * Lookup time of the children table against the linear array it replaced.
+ * NENTRIES children are added as direct neighbours, then get_children is
+ * timed over all of them. RANDOM_ADDRS uses random 8 byte addresses instead
+ * of the sequential node ids Cooja gives.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* print_data_packet and the like print directly */
+#define printf(...) 0
+#include "custom-routing.c"
+#undef printf
+
+#ifndef NENTRIES
+#define NENTRIES 16
+#endif
+
+#define ITERATIONS 2000000L
+
+/* The previous linear table */
+static child_t linear[NENTRIES];
+static int linear_size = 0;
+
+static int linear_get(const linkaddr_t* addr, linkaddr_t* nexthop) {
+  for (int i = 0; i < linear_size; i++) {
+    if (linkaddr_cmp(&linear[i].addr, addr)) {
+      *nexthop = linear[i].from;
+      return i;
+    }
+  }
+  return -1;
+}
+
+static double now_ns(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int main(void) {
+  static linkaddr_t addrs[NENTRIES];
+
+  for (int i = 0; i < NENTRIES; i++) {
+    linkaddr_t addr = {{0}};
+#ifdef RANDOM_ADDRS
+    for (uint8_t b = 0; b < sizeof(linkaddr_t); b++) {
+      addr.u8[b] = rand();
+    }
+#else
+    uint16_t id = i + 2;
+    addr.u8[0] = id & 0xFF;
+    addr.u8[1] = id >> 8;
+#endif
+    addrs[i] = addr;
+
+    uint8_t setup_ack[2 + LEN_ADDR] = {0};
+    setup_ack[1] = i % 4;
+    uint8_t len_addr = packing_addr(setup_ack + 2, &addr);
+    if (set_child(&addr, setup_ack, 2 + len_addr) == -1) {
+      fprintf(stderr, "children table full at %d, raise ROUTING_CONF_CHILDREN_TABLE_SIZE\n", i);
+      return 1;
+    }
+    linear[linear_size].addr = addr;
+    linear[linear_size].from = addr;
+    linear_size++;
+  }
+
+  volatile int sink = 0;
+  linkaddr_t nexthop;
+  double t0 = now_ns();
+  for (long k = 0; k < ITERATIONS; k++) {
+    sink += get_children(&addrs[k % NENTRIES], &nexthop);
+  }
+  double t1 = now_ns();
+  for (long k = 0; k < ITERATIONS; k++) {
+    sink += linear_get(&addrs[k % NENTRIES], &nexthop);
+  }
+  double t2 = now_ns();
+
+  long probes = 0;
+  for (int i = 0; i < NENTRIES; i++) {
+    uint16_t home = child_hash(&addrs[i]);
+    int slot = find_child_slot(&addrs[i]);
+    probes += ((slot - home) & (CHILDREN_TABLE_SIZE - 1)) + 1;
+  }
+
+#ifdef RANDOM_ADDRS
+  const char* kind = "random";
+#else
+  const char* kind = "node id";
+#endif
+  fprintf(stderr, "%s addresses, entries %d table %d: hash %.1f ns/lookup (%.2f probes), linear %.1f ns/lookup (%.1f compares)\n",
+    kind, NENTRIES, CHILDREN_TABLE_SIZE,
+    (t1 - t0) / ITERATIONS, (double)probes / NENTRIES,
+    (t2 - t1) / ITERATIONS, (NENTRIES + 1) / 2.0);
+  return 0;
+}
@@ -0,0 +1,268 @@
+/*
+ * Cost of forwarding a data frame, forward_data_packet against the code of
+ * the first version of the routing, copied below with a baseline_ prefix. It
+ * decoded the frame into a data_packet_t with a malloc'd topic and payload,
+ * encoded it again and handed it to the network right away, looking the next
+ * hops up in a linear children array. forward_data_packet queues the frame,
+ * the queue is drained after every frame so it never fills and the drain is
+ * counted. Counted with rdtsc, x86 only.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+
+/* print_data_packet and the like print directly */
+#define printf(...) 0
+#include "custom-routing.c"
+#undef printf
+
+#define ITERATIONS 1000000
+#define ROUNDS 5
+
+static parent_t parent;
+
+/* First version, full addresses in the header and text topic and data */
+#define BASELINE_LEN_HEADER (2 * sizeof(linkaddr_t))
+#define BASELINE_LEN_DATA_HEADER (sizeof(uint8_t) + 2 * sizeof(uint16_t))
+
+typedef struct {
+  uint8_t type;
+  uint8_t up;
+  uint8_t multicast_group;
+  uint16_t len_topic;
+  uint16_t len_data;
+  uint8_t mobile_flags;
+  linkaddr_t dest;
+} baseline_data_header_t;
+
+typedef struct {
+  baseline_data_header_t header;
+  char* topic;
+  char* data;
+} baseline_data_packet_t;
+
+static child_t baseline_children[16];
+static uint8_t baseline_children_count = 0;
+
+static int baseline_get_multicast_children(uint8_t multicast_group, linkaddr_t* nexthop, int start_index) {
+  for (int i = start_index; i < baseline_children_count; i++) {
+    if (baseline_children[i].multicast_group == multicast_group) {
+      *nexthop = baseline_children[i].from;
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void baseline_packing_data_packet(baseline_data_packet_t* data_packet, uint8_t* data) {
+  data[0] = 0;
+  data[0] = data_packet->header.type << 7;
+  data[0] |= data_packet->header.up << 6;
+  data[0] |= data_packet->header.multicast_group << 2;
+  data[0] |= data_packet->header.mobile_flags;
+
+  memcpy(data + 1, &data_packet->header.len_topic, sizeof(uint16_t));
+  memcpy(data + 3, &data_packet->header.len_data, sizeof(uint16_t));
+
+  uint8_t offset = 0;
+  if (data_packet->header.up == 0) {
+    memcpy(data + BASELINE_LEN_DATA_HEADER, &data_packet->header.dest, sizeof(linkaddr_t));
+    offset = sizeof(linkaddr_t);
+  }
+
+  memcpy(data + offset + BASELINE_LEN_DATA_HEADER, data_packet->topic, data_packet->header.len_topic);
+  memcpy(data + offset + BASELINE_LEN_DATA_HEADER + data_packet->header.len_topic, data_packet->data, data_packet->header.len_data);
+}
+
+/* Without its check for an empty frame, which left the packet of the caller
+ * uninitialised and is never taken here */
+static void baseline_process_data_packet(const uint8_t *input_data, uint16_t len, baseline_data_packet_t* data_packet) {
+  baseline_data_header_t header;
+  header.type = input_data[BASELINE_LEN_HEADER] >> 7;
+  header.up = (input_data[BASELINE_LEN_HEADER] >> 6) & 0x1;
+  header.multicast_group = (input_data[BASELINE_LEN_HEADER] >> 2) & 0xF;
+  header.mobile_flags = input_data[BASELINE_LEN_HEADER] & 0x3;
+
+  memcpy(&header.len_topic, input_data + BASELINE_LEN_HEADER + 1, sizeof(uint16_t));
+  memcpy(&header.len_data, input_data + BASELINE_LEN_HEADER + 3, sizeof(uint16_t));
+
+  uint8_t offset = 0;
+  if (header.up == 0) {
+    header.dest = *((linkaddr_t*)(input_data + BASELINE_LEN_HEADER + BASELINE_LEN_DATA_HEADER));
+    offset = sizeof(linkaddr_t);
+  }
+
+  char* data_topic = malloc(sizeof(char) * (header.len_topic + 1));
+  char* data = malloc(sizeof(char) * (header.len_data + 1));
+
+  memcpy(data_topic, input_data + BASELINE_LEN_HEADER + BASELINE_LEN_DATA_HEADER + offset, header.len_topic);
+  memcpy(data, input_data + BASELINE_LEN_HEADER + BASELINE_LEN_DATA_HEADER + offset + header.len_topic, header.len_data);
+
+  data_topic[header.len_topic] = '\0';
+  data[header.len_data] = '\0';
+
+  data_packet->header = header;
+  data_packet->topic = data_topic;
+  data_packet->data = data;
+}
+
+static void baseline_forward_data_packet(const void *data, uint16_t len, parent_t* parent) {
+  baseline_data_packet_t data_packet;
+  baseline_process_data_packet(data, len, &data_packet);
+
+  uint8_t output[len];
+  memcpy(output, data, sizeof(linkaddr_t));
+  baseline_packing_data_packet(&data_packet, output + BASELINE_LEN_HEADER);
+  free(data_packet.topic);
+  free(data_packet.data);
+
+  if (data_packet.header.up == 1) {
+    memcpy(output + sizeof(linkaddr_t), &parent->parent_addr, sizeof(linkaddr_t));
+    nullnet_buf = output;
+    nullnet_len = len;
+
+    const linkaddr_t dest = parent->parent_addr;
+    NETSTACK_NETWORK.output(&dest);
+    return;
+  }
+
+  linkaddr_t nexthop;
+  linkaddr_t sent_nexthop[baseline_children_count];
+  int sent_count = 0;
+  int start_index = baseline_get_multicast_children(data_packet.header.multicast_group, &nexthop, 0);
+  while (start_index != -1) {
+    memcpy(output + sizeof(linkaddr_t), &nexthop, sizeof(linkaddr_t));
+    nullnet_buf = output;
+    nullnet_len = len;
+    NETSTACK_NETWORK.output(&nexthop);
+    sent_nexthop[sent_count] = nexthop;
+    sent_count++;
+
+    start_index = baseline_get_multicast_children(data_packet.header.multicast_group, &nexthop, start_index + 1);
+    while (start_index != -1) {
+      uint8_t found = 0;
+      for (int i = 0; i < sent_count; i++) {
+        if (linkaddr_cmp(&sent_nexthop[i], &nexthop)) {
+          found = 1;
+          break;
+        }
+      }
+      if (!found) {
+        break;
+      }
+      start_index = baseline_get_multicast_children(data_packet.header.multicast_group, &nexthop, start_index + 1);
+    }
+  }
+}
+
+/* The same message in the first frame format */
+static uint16_t make_baseline_frame(uint8_t* frame, uint8_t up, const char* topic, const char* data, uint8_t multicast_group) {
+  linkaddr_t origin = {{9}};
+  linkaddr_t dest = {{7}};
+  baseline_data_packet_t data_packet;
+  data_packet.header.type = DATA;
+  data_packet.header.up = up;
+  data_packet.header.multicast_group = multicast_group;
+  data_packet.header.len_topic = strlen(topic);
+  data_packet.header.len_data = strlen(data);
+  data_packet.header.dest = dest;
+  data_packet.header.mobile_flags = NOT_MOBILE;
+  data_packet.topic = (char*)topic;
+  data_packet.data = (char*)data;
+
+  memcpy(frame, &origin, sizeof(linkaddr_t));
+  memcpy(frame + sizeof(linkaddr_t), &linkaddr_node_addr, sizeof(linkaddr_t));
+  baseline_packing_data_packet(&data_packet, frame + BASELINE_LEN_HEADER);
+  return BASELINE_LEN_HEADER + BASELINE_LEN_DATA_HEADER + (up ? 0 : sizeof(linkaddr_t)) + strlen(topic) + strlen(data);
+}
+
+static void drain(void) {
+  tx_entry_t* entry;
+  while ((entry = tx_pick(0)) != NULL) {
+    nullnet_buf = entry->frame;
+    nullnet_len = entry->len;
+    NETSTACK_NETWORK.output(&entry->dest);
+    tx_free(entry);
+  }
+}
+
+/* A frame as received, with a reading or a command as payload */
+static uint16_t make_frame(uint8_t* frame, uint8_t up, uint8_t topic, uint8_t multicast_group) {
+  uint8_t payload[16];
+  tlv_writer_t writer;
+  tlv_init(&writer, payload, sizeof(payload));
+  if (up) {
+    tlv_put_u8(&writer, 200);
+  } else {
+    tlv_put_bool(&writer, 1);
+    tlv_put_duration(&writer, 60);
+  }
+
+  linkaddr_t origin = {{9}};
+  linkaddr_t dest = {{7}};
+  data_packet_t data_packet;
+  build_data_header(&data_packet, up, multicast_group, topic, writer.len, payload, &dest, NOT_MOBILE);
+  uint8_t len_header = packing_header(frame, &origin, &linkaddr_node_addr);
+  packing_data_packet(&data_packet, frame + len_header);
+  return len_header + get_data_packet_len(&data_packet);
+}
+
+int main(void) {
+  linkaddr_t self = {{5}};
+  linkaddr_node_addr = self;
+  parent.parent_addr.u8[0] = 1;
+
+  /* A single next hop for the commands going down */
+  linkaddr_t child = {{7}};
+  uint8_t setup_ack[2 + LEN_ADDR] = {0};
+  setup_ack[1] = LIGHT_BULB_GROUP;
+  uint8_t len_addr = packing_addr(setup_ack + 2, &child);
+  set_child(&child, setup_ack, 2 + len_addr);
+  baseline_children[baseline_children_count].addr = child;
+  baseline_children[baseline_children_count].from = child;
+  baseline_children[baseline_children_count].multicast_group = LIGHT_BULB_GROUP;
+  baseline_children_count++;
+
+  /* The topics and values the first version sent as text */
+  struct {
+    const char* name;
+    uint8_t up;
+    uint8_t topic;
+    const char* topic_text;
+    const char* data_text;
+  } cases[] = {
+    {"light reading up", 1, TOPIC_LIGHT, "light", "200"},
+    {"lights command down", 0, TOPIC_LIGHTS, "lights", "on"},
+  };
+
+  for (uint8_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+    uint8_t frame[FRAME_MTU];
+    uint16_t len = make_frame(frame, cases[k].up, cases[k].topic, LIGHT_BULB_GROUP);
+    uint8_t baseline_frame[128];
+    uint16_t baseline_len = make_baseline_frame(baseline_frame, cases[k].up, cases[k].topic_text, cases[k].data_text, LIGHT_BULB_GROUP);
+    unsigned long long best_baseline = -1ULL, best_in_place = -1ULL;
+
+    for (int r = 0; r < ROUNDS; r++) {
+      unsigned long long t0 = __rdtsc();
+      for (int i = 0; i < ITERATIONS; i++) {
+        baseline_forward_data_packet(baseline_frame, baseline_len, &parent);
+      }
+      unsigned long long t1 = __rdtsc();
+      for (int i = 0; i < ITERATIONS; i++) {
+        forward_data_packet(frame, len, &parent);
+        drain();
+      }
+      unsigned long long t2 = __rdtsc();
+      if (t1 - t0 < best_baseline) {
+        best_baseline = t1 - t0;
+      }
+      if (t2 - t1 < best_in_place) {
+        best_in_place = t2 - t1;
+      }
+    }
+
+    fprintf(stderr, "%s: first version (%u B) %.0f cycles, in place and queued (%u B) %.0f cycles\n",
+      cases[k].name, baseline_len, (double)best_baseline / ITERATIONS, len, (double)best_in_place / ITERATIONS);
+  }
+  return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Ack windows: only an ack from the neighbour a packet went to clears it, a
+ * late ack inside the window counts, a packet with ACK_WINDOW newer ones
+ * sent after it is lost, the packets without ack before the last one are
+ * counted, and past ACK_WINDOWS neighbours the oldest window is reused.
+ * Sequence numbers are shared by the windows and skip 0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* print_data_packet and the like print directly */
+#define printf(...) 0
+#include "custom-routing.c"
+#undef printf
+
+#include "check.h"
+
+static linkaddr_t neighbour(uint8_t id) {
+  linkaddr_t addr = {{0}};
+  addr.u8[0] = id;
+  addr.u8[1] = 0xA0;
+  return addr;
+}
+
+static ack_stats_t stats_of(const linkaddr_t* dest) {
+  ack_stats_t stats;
+  memset(&stats, 0xFF, sizeof(stats));
+  CHECK(ack_window_stats(dest, &stats) == 0);
+  return stats;
+}
+
+int main(void) {
+  linkaddr_t self = {{0xFE, 0xFE}};
+  linkaddr_node_addr = self;
+
+  /* All taken, the first one created goes, then the second */
+  linkaddr_t dests[ACK_WINDOWS + 1];
+  for (uint8_t i = 0; i <= ACK_WINDOWS; i++) {
+    dests[i] = neighbour(i + 1);
+    ack_window_send(ack_window(&dests[i], 1));
+  }
+  ack_stats_t stats;
+  CHECK(ack_window_stats(&dests[0], &stats) == -1);
+  for (uint8_t i = 1; i <= ACK_WINDOWS; i++) {
+    CHECK(stats_of(&dests[i]).sent == 1);
+  }
+  ack_window(&dests[0], 1);
+  CHECK(stats_of(&dests[0]).sent == 0);
+  CHECK(ack_window_stats(&dests[1], &stats) == -1);
+  CHECK(ack_window(&dests[1], 0) == NULL);
+
+  /* An ack from another neighbour, then the right one, then a repeat */
+  linkaddr_t a = neighbour(0x10), b = neighbour(0x11);
+  ack_window_t* wa = ack_window(&a, 1);
+  ack_window(&b, 1);
+  uint8_t seq = ack_window_send(wa);
+  ack_window_ack(&b, seq);
+  CHECK(stats_of(&a).outstanding == 1 && stats_of(&a).acked == 0);
+  ack_window_ack(&a, seq);
+  CHECK(stats_of(&a).outstanding == 0 && stats_of(&a).acked == 1);
+  ack_window_ack(&a, seq);
+  CHECK(stats_of(&a).acked == 1);
+
+  /* Shared numbering, 0 is skipped on wrapping */
+  uint8_t seq_b = ack_window_send(ack_window(&b, 0));
+  CHECK(seq_b == (uint8_t)(seq + 1));
+  last_seq = 0xFE;
+  CHECK(ack_window_send(wa) == 0xFF);
+  CHECK(ack_window_send(wa) == 1);
+  ack_window_ack(&a, 0xFF);
+  ack_window_ack(&a, 1);
+
+  /* Late but inside the window, then one ACK_WINDOW sends too late */
+  linkaddr_t c = neighbour(0x12);
+  ack_window_t* wc = ack_window(&c, 1);
+  uint8_t late = ack_window_send(wc);
+  for (uint8_t i = 0; i < ACK_WINDOW - 1; i++) {
+    ack_window_send(wc);
+  }
+  ack_window_ack(&c, late);
+  stats = stats_of(&c);
+  CHECK(stats.acked == 1 && stats.lost == 0 && stats.outstanding == ACK_WINDOW - 1);
+  uint8_t lost = ack_window_send(wc);
+  for (uint8_t i = 0; i < ACK_WINDOW; i++) {
+    ack_window_send(wc);
+  }
+  stats = stats_of(&c);
+  CHECK(stats.sent == 2 * ACK_WINDOW + 1);
+  CHECK(stats.lost == ACK_WINDOW);
+  CHECK(stats.outstanding == ACK_WINDOW);
+  ack_window_ack(&c, lost);
+  CHECK(stats_of(&c).acked == 1);
+
+  /* Unacked before the last one, up to the last ack */
+  linkaddr_t d = neighbour(0x13);
+  ack_window_t* wd = ack_window(&d, 1);
+  uint8_t seqs[4];
+  for (uint8_t i = 0; i < 4; i++) {
+    seqs[i] = ack_window_send(wd);
+  }
+  CHECK(ack_window_unacked(wd) == 3);
+  ack_window_ack(&d, seqs[1]);
+  CHECK(ack_window_unacked(wd) == 1);
+  ack_window_ack(&d, seqs[3]);
+  CHECK(ack_window_unacked(wd) == 1);
+  ack_window_ack(&d, seqs[2]);
+  CHECK(ack_window_unacked(wd) == 0);
+
+  /* A drop keeps only the last packet waiting */
+  for (uint8_t i = 0; i < 3; i++) {
+    seqs[i] = ack_window_send(wd);
+  }
+  CHECK(ack_window_unacked(wd) == 2);
+  ack_window_drop(wd);
+  stats = stats_of(&d);
+  CHECK(stats.lost == 3 && stats.outstanding == 1);
+  CHECK(ack_window_unacked(wd) == 0);
+  ack_window_ack(&d, seqs[2]);
+  CHECK(stats_of(&d).outstanding == 0);
+  return check_done("ack windows");
+}
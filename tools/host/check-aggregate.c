@@ -0,0 +1,117 @@
+/*
+ * Aggregation of the upward data: records of distinct origins fill the
+ * aggregate, a repeated one is dropped. Once it is full and the frame pool is
+ * empty the next packet goes on alone, and is not taken for a duplicate when
+ * forward_data_packet checks it. With a frame back the full aggregate is sent
+ * with every record in order and the new one starts the next.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* print_data_packet and the like print directly */
+#define printf(...) 0
+#include "custom-routing.c"
+#undef printf
+
+#include "check.h"
+
+#define LEN_DATA 4
+#define NRECORDS ((int)(AGGREGATE_MAX / (LEN_RECORD_HEADER + LEN_DATA)) + 2)
+
+static parent_t parent;
+static linkaddr_t origins[NRECORDS];
+static uint8_t payloads[NRECORDS][LEN_DATA];
+
+static int aggregate(int i) {
+  data_packet_view_t view;
+  memset(&view, 0, sizeof(view));
+  view.header.up = 1;
+  view.header.topic = TOPIC_LIGHT;
+  view.header.seq = i + 1;
+  view.header.len_data = LEN_DATA;
+  view.data = payloads[i];
+  return aggregate_data_packet(&view, &origins[i], &parent);
+}
+
+static uint16_t record_len(int i) {
+  uint8_t buf[LEN_ADDR];
+  return packing_addr(buf, &origins[i]) + LEN_RECORD_HEADER + LEN_DATA;
+}
+
+/* The next queued frame is an aggregate holding the records first to last */
+static void check_sent(int first, int last) {
+  tx_entry_t* entry = tx_pick(0);
+  CHECK(entry != NULL);
+  if (entry == NULL) {
+    return;
+  }
+  data_packet_view_t view;
+  CHECK(process_data_view(entry->frame, entry->len, &view) == 0);
+  CHECK(view.header.up == 1 && view.header.topic == TOPIC_AGGREGATE);
+  CHECK(linkaddr_cmp(&entry->dest, &parent.parent_addr));
+
+  aggregate_record_t record;
+  uint16_t offset = 0;
+  int i = first;
+  while (aggregate_next(view.data, view.header.len_data, &offset, &record) == 0) {
+    CHECK(i <= last);
+    CHECK(i > last || linkaddr_cmp(&record.origin, &origins[i]));
+    CHECK(record.seq == i + 1 && record.len_data == LEN_DATA);
+    CHECK(i > last || memcmp(record.data, payloads[i], LEN_DATA) == 0);
+    i++;
+  }
+  CHECK(i == last + 1);
+  tx_free(entry);
+}
+
+int main(void) {
+  linkaddr_t self = {{0xFE, 0xFE}};
+  linkaddr_node_addr = self;
+  parent.parent_addr.u8[0] = 1;
+
+  for (int i = 0; i < NRECORDS; i++) {
+    origins[i].u8[0] = 10 + i;
+    origins[i].u8[1] = 1;
+    memset(payloads[i], i, LEN_DATA);
+  }
+
+  /* A repeated record does not take room */
+  CHECK(aggregate(0) == 0);
+  uint16_t len = aggregate_len;
+  CHECK(len == record_len(0));
+  CHECK(aggregate(0) == 0);
+  CHECK(aggregate_len == len);
+
+  int n = 1;
+  while (aggregate_len + record_len(n) <= AGGREGATE_MAX) {
+    CHECK(aggregate(n) == 0);
+    n++;
+  }
+  CHECK(n < NRECORDS - 1);
+  CHECK(tx_pick(0) == NULL);
+
+  /* Full and no frame to send it in */
+  uint8_t* held[FRAME_POOL_SIZE];
+  uint8_t nheld = 0;
+  while (nheld < FRAME_POOL_SIZE && (held[nheld] = frame_acquire()) != NULL) {
+    nheld++;
+  }
+  CHECK(frame_acquire() == NULL);
+  len = aggregate_len;
+  CHECK(aggregate(n) == -1);
+  CHECK(aggregate(n) == -1);
+  CHECK(aggregate_len == len);
+  CHECK(!is_duplicate(&origins[n], n + 1, DUP_FORWARD_LIFETIME));
+
+  for (uint8_t i = 0; i < nheld; i++) {
+    frame_release(held[i]);
+  }
+  CHECK(aggregate(n + 1) == 0);
+  CHECK(aggregate_len == record_len(n + 1));
+  check_sent(0, n - 1);
+  CHECK(aggregate_flush() == 0);
+  CHECK(aggregate_len == 0);
+  check_sent(n + 1, n + 1);
+  CHECK(tx_pick(0) == NULL);
+  return check_done("aggregation");
+}
@@ -0,0 +1,100 @@
+/*
+ * Children table: random adds, moves and removals against a plain array.
+ * The addresses all hash to the last two or first two slots, so the probe
+ * sequences are long and wrap around the end of the table, which is where the
+ * backward shift deletion has the most to repair. After every step each child
+ * is found with its next hop, removed ones are not, and every entry is reached
+ * from its home slot without crossing a free one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* print_data_packet and the like print directly */
+#define printf(...) 0
+#include "custom-routing.c"
+#undef printf
+
+#include "check.h"
+
+#define NADDRS (MAX_CHILDREN + 8)
+#define NHOPS 4
+#define STEPS 4000
+
+static linkaddr_t addrs[NADDRS];
+static uint8_t present[NADDRS];
+static uint8_t hop_of[NADDRS];
+static linkaddr_t hops[NHOPS];
+
+/* No free slot between the home slot of an entry and the entry */
+static int probe_paths_intact(void) {
+  for (uint16_t i = 0; i < CHILDREN_TABLE_SIZE; i++) {
+    if (!children_used[i]) {
+      continue;
+    }
+    for (uint16_t k = child_hash(&children[i].addr); k != i; k = (k + 1) & (CHILDREN_TABLE_SIZE - 1)) {
+      if (!children_used[k]) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+int main(void) {
+  linkaddr_t self = {{0xFE, 0xFE}};
+  linkaddr_node_addr = self;
+
+  for (uint8_t h = 0; h < NHOPS; h++) {
+    hops[h].u8[0] = 0xF0 + h;
+    hops[h].u8[7] = 0xF0;
+  }
+  int n = 0;
+  for (uint32_t id = 1; n < NADDRS; id++) {
+    linkaddr_t addr = {{0}};
+    addr.u8[0] = id & 0xFF;
+    addr.u8[1] = (id >> 8) & 0xFF;
+    addr.u8[2] = id >> 16;
+    uint16_t home = child_hash(&addr);
+    if (home < 2 || home >= CHILDREN_TABLE_SIZE - 2) {
+      addrs[n++] = addr;
+    }
+  }
+
+  srand(1);
+  int count = 0;
+  for (int step = 0; step < STEPS; step++) {
+    int k = rand() % NADDRS;
+    if (rand() % 3) {
+      uint8_t h = rand() % NHOPS;
+      int index = child_add(&hops[h], &addrs[k], 0);
+      CHECK(index != -1 || (!present[k] && count >= MAX_CHILDREN));
+      if (index != -1) {
+        count += !present[k];
+        present[k] = 1;
+        hop_of[k] = h;
+      }
+    } else {
+      int index = find_child_slot(&addrs[k]);
+      CHECK((index != -1) == present[k]);
+      if (index != -1) {
+        child_remove(index);
+        present[k] = 0;
+        count--;
+      }
+    }
+
+    CHECK(children_count == count);
+    CHECK(probe_paths_intact());
+    for (int i = 0; i < NADDRS; i++) {
+      linkaddr_t nexthop;
+      int index = get_children(&addrs[i], &nexthop);
+      CHECK((index != -1) == present[i]);
+      CHECK(index == -1 || linkaddr_cmp(&nexthop, &hops[hop_of[i]]));
+    }
+    if (check_failures) {
+      fprintf(stderr, "at step %d\n", step);
+      break;
+    }
+  }
+  return check_done("children table");
+}
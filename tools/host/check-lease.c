@@ -0,0 +1,95 @@
+/*
+ * Lease wheel: a full table of children behind a few next hops. Nothing
+ * expires before CHILD_LEASE_SLOTS ticks, traffic of a routed child renews it
+ * and its next hop, the children left alone expire on the next tick, and the
+ * rest a lease later. After every tick each used slot is in the list of the
+ * slot its lease ends in, exactly once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* print_data_packet and the like print directly */
+#define printf(...) 0
+#include "custom-routing.c"
+#undef printf
+
+#include "check.h"
+
+#define NHOPS 4
+#define NROUTED (MAX_CHILDREN - NHOPS)
+
+static linkaddr_t hops[NHOPS];
+static linkaddr_t routed[NROUTED];
+
+/* Every used slot once in the wheel, with its own slot number and back link */
+static int lease_lists_intact(void) {
+  int linked = 0;
+  for (uint8_t s = 0; s < CHILD_LEASE_SLOTS; s++) {
+    table_link_t prev = 0;
+    for (table_link_t i = lease_head[s]; i; i = lease_next[i - 1]) {
+      if (!children_used[i - 1] || lease_prev[i - 1] != prev || lease_slot[i - 1] != s) {
+        return 0;
+      }
+      prev = i;
+      linked++;
+    }
+  }
+  return linked == children_count;
+}
+
+static void tick(void) {
+  lease_tick(NULL);
+  CHECK(lease_lists_intact());
+}
+
+int main(void) {
+  linkaddr_t self = {{0xFE, 0xFE}};
+  linkaddr_node_addr = self;
+
+  for (uint8_t h = 0; h < NHOPS; h++) {
+    hops[h].u8[0] = 0xF0 + h;
+    hops[h].u8[1] = 0xFF;
+    CHECK(child_add(&hops[h], &hops[h], 0) != -1);
+  }
+  /* Even and odd children share the next hops, so renewing the even ones keeps every hop */
+  for (int i = 0; i < NROUTED; i++) {
+    routed[i].u8[0] = i & 0xFF;
+    routed[i].u8[1] = 1 + (i >> 8);
+    CHECK(child_add(&hops[(i / 2) % NHOPS], &routed[i], 0) != -1);
+  }
+  CHECK(children_count == MAX_CHILDREN);
+  CHECK(lease_lists_intact());
+
+  for (uint8_t t = 0; t < CHILD_LEASE_SLOTS - 1; t++) {
+    tick();
+  }
+  CHECK(children_count == MAX_CHILDREN);
+
+  for (int i = 0; i < NROUTED; i += 2) {
+    child_refresh(&routed[i]);
+  }
+  CHECK(lease_lists_intact());
+  tick();
+  CHECK(children_count == NHOPS + (NROUTED + 1) / 2);
+  for (uint8_t h = 0; h < NHOPS; h++) {
+    CHECK(find_child_slot(&hops[h]) != -1);
+  }
+  for (int i = 0; i < NROUTED; i++) {
+    linkaddr_t nexthop;
+    int index = get_children(&routed[i], &nexthop);
+    CHECK((index != -1) == (i % 2 == 0));
+    CHECK(index == -1 || linkaddr_cmp(&nexthop, &hops[(i / 2) % NHOPS]));
+  }
+
+  /* Renewed a tick ago */
+  for (uint8_t t = 0; t < CHILD_LEASE_SLOTS - 2; t++) {
+    tick();
+  }
+  CHECK(children_count == NHOPS + (NROUTED + 1) / 2);
+  tick();
+  CHECK(children_count == 0);
+  for (uint8_t s = 0; s < CHILD_LEASE_SLOTS; s++) {
+    CHECK(lease_head[s] == 0);
+  }
+  return check_done("lease wheel");
+}
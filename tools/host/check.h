@@ -0,0 +1,24 @@
+/*
+ * Shared by the check-*.c programs. A failed CHECK prints its condition and
+ * line, check_done prints the verdict and gives the exit status.
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+static int check_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+      check_failures++; \
+    } \
+  } while (0)
+
+static int check_done(const char* name) {
+  fprintf(stderr, "%s, table %d: %s\n", name, CHILDREN_TABLE_SIZE, check_failures ? "FAILED" : "ok");
+  return check_failures != 0;
+}
+
+#endif
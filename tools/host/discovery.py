@@ -0,0 +1,326 @@
+"""Discovery convergence model: unit-disk radio, CSMA with clear channel
+assessment, collisions at the receiver (hidden terminals), frame airtime
+from the frame length at 250 kbps.  Parent rules follow custom-routing.c:
+sub-gateways join the gateway, nodes join sub-gateways or nodes, never the
+gateway, and prefer a sub-gateway.
+
+usage: discovery.py MODE [DEVICES [RUNS [BOOT_SPREAD]]]
+    MODE is old (fixed 8 s SETUP), trickle, jitter (RESPONSE jitter and
+    cancellation) or rank (parents chosen by path cost).
+    AREA (side in m, 100), JITTER (s, 0.125 as RESPONSE_JITTER), STAGGER (0 or 1),
+    SETUP_IMAX (s, 8 as TRICKLE_SETUP_IMAX) and LATE (s, 0, an extra node booted at 0
+    next to a sub-gateway is out of range until then) are read from the environment."""
+import heapq, math, os, random, sys
+
+GW, SUB, NODE = 2, 1, 0
+RANGE = 35.0
+AIRTIME = (6 + 11 + 20) * 8 / 250000.0  # PHY + MAC + routing bytes
+SLOT = 1.0 / 128  # CSMA backoff period on a 128 Hz clock, as in Cooja
+
+class Net:
+    def __init__(self, n_nodes, seed, mode, boot_spread=1.0):
+        self.rng = random.Random(seed)
+        self.mode = mode
+        self.pos, self.type = [], []
+        a = AREA / 100.0
+        self.add((50 * a, 50 * a), GW)
+        for p in [(25, 30), (75, 30), (50, 80)]:
+            self.add((p[0] + 50 * (a - 1), p[1] + 50 * (a - 1)), SUB)
+        while len(self.pos) < n_nodes + 4:
+            self.add((self.rng.uniform(0, AREA), self.rng.uniform(0, AREA)), NODE)
+        if LATE:
+            self.add((self.pos[1][0] + 5, self.pos[1][1] + 5), NODE)
+        n = len(self.pos)
+        self.nbr = [[j for j in range(n) if j != i and self.dist(i, j) <= RANGE] for i in range(n)]
+        if LATE:
+            self.late_nbr = self.nbr[n - 1]
+            self.nbr[n - 1] = []
+            for j in self.late_nbr:
+                self.nbr[j].remove(n - 1)
+        self.parent = [None] * n
+        self.rank = [None] * n
+        self.attached_at = [None] * n
+        self.parent[0] = 0; self.rank[0] = 0; self.attached_at[0] = 0.0
+        self.events, self.seq = [], 0
+        self.tx_until = [0.0] * n        # end of own transmission
+        self.rx = [[] for _ in range(n)]  # frames being received: (start, end, frame)
+        self.frames = {"SETUP": 0, "RESPONSE": 0, "SETUP_ACK": 0}
+        self.collisions = 0
+        self.acked = set()
+        self.boot = [0.0] + [self.rng.uniform(0, boot_spread) for _ in range(n - 1)]
+        self.tr = [None] * n
+        self.pending = [None] * n        # jittered response, mode "jitter"
+        for i in range(n):
+            self.at(self.boot[i], self.start, i)
+        if LATE:
+            self.at(LATE, self.in_range, n - 1)
+
+    def in_range(self, i, now):
+        self.nbr[i] = self.late_nbr
+        for j in self.late_nbr:
+            self.nbr[j].append(i)
+
+    def add(self, p, t):
+        self.pos.append(p); self.type.append(t)
+
+    def dist(self, i, j):
+        return math.hypot(self.pos[i][0] - self.pos[j][0], self.pos[i][1] - self.pos[j][1])
+
+    def reachable(self):
+        """Nodes that can get a parent at all under the parent rules."""
+        ok = {0}
+        changed = True
+        while changed:
+            changed = False
+            for i in range(len(self.pos)):
+                if i in ok:
+                    continue
+                if self.type[i] == SUB and 0 in self.nbr[i]:
+                    ok.add(i); changed = True
+                if self.type[i] == NODE and any(j in ok and self.type[j] != GW for j in self.nbr[i]):
+                    ok.add(i); changed = True
+        return ok
+
+    def at(self, t, f, *a):
+        self.seq += 1
+        heapq.heappush(self.events, (t, self.seq, f, a))
+
+    # ---- radio
+    def busy(self, i, now):
+        return self.tx_until[i] > now or any(end > now for (_, end, _) in self.rx[i])
+
+    def send(self, i, now, kind, dest=None):
+        """Contiki CSMA: random initial backoff, CCA, retries for unicast frames without ack."""
+        self.at(now + self.rng.randint(0, 7) * SLOT, self.attempt, i, kind, dest, 0, 0)
+
+    def attempt(self, i, kind, dest, busy, tries, now):
+        if self.busy(i, now):
+            if busy >= 5:
+                return
+            be = min(3 + busy + 1, 5)
+            self.at(now + self.rng.randint(0, 2 ** be - 1) * SLOT, self.attempt, i, kind, dest, busy + 1, tries)
+            return
+        self.frames[kind] += 1
+        end = now + AIRTIME
+        self.tx_until[i] = end
+        frame = (i, kind, dest, self.type[i], self.rank[i], tries)
+        for j in self.nbr[i]:
+            self.rx[j].append((now, end, frame))
+            self.at(end, self.deliver, j, (now, end, frame))
+        if dest is not None:
+            self.at(end + 0.002, self.check_ack, i, kind, dest, tries, frame)
+
+    def check_ack(self, i, kind, dest, tries, frame, now):
+        if frame in self.acked:
+            self.acked.discard(frame)
+            return
+        if tries < 7:
+            be = min(3 + tries + 1, 5)
+            self.at(now + self.rng.randint(0, 2 ** be - 1) * SLOT, self.attempt, i, kind, dest, 0, tries + 1)
+
+    def deliver(self, j, entry, now):
+        self.rx[j].remove(entry)
+        start, end, frame = entry
+        overlap = any(s < end and e > start for (s, e, _) in self.rx[j]) or self.tx_until[j] > start
+        # frames still on air that started before this one ended were already found above,
+        # the ones that ended before are kept in a short history
+        overlap = overlap or any(s < end and e > start for (s, e) in getattr(self, "hist", {}).get(j, []))
+        self.hist = getattr(self, "hist", {})
+        self.hist.setdefault(j, []).append((start, end))
+        self.hist[j] = [(s, e) for (s, e) in self.hist[j] if e > now - 0.01]
+        if overlap:
+            self.collisions += 1
+            return
+        src, kind, dest, stype, srank, _ = frame
+        if dest is not None and dest != j:
+            return
+        if dest is not None:
+            self.acked.add(frame)
+        self.receive(j, src, kind, stype, srank, now)
+
+    # ---- protocol
+    def can_parent(self, j, stype):
+        if self.type[j] == SUB:
+            return stype == GW
+        if self.type[j] == NODE:
+            return stype in (SUB, NODE)
+        return False
+
+    def etx(self, i, j):
+        prr = 1 - 0.8 * (self.dist(i, j) / RANGE) ** 4
+        return 1 / prr
+
+    def descendant(self, j, src):
+        k, h = src, 0
+        while k is not None and k != 0 and h < 100:
+            if k == j:
+                return True
+            k = self.parent[k]; h += 1
+        return False
+
+    def better(self, j, src, stype, srank):
+        cur = self.parent[j]
+        if self.mode == "rank" and self.descendant(j, src):
+            return False
+        if cur is None:
+            return True
+        if self.mode == "rank":
+            if src == cur:
+                self.rank[j] = srank + self.etx(j, src)
+                return False
+            return srank + self.etx(j, src) + 0.5 < self.rank[j]
+        return stype > self.type[cur]
+
+    def attach(self, j, src, srank, now):
+        self.parent[j] = src
+        self.rank[j] = srank + self.etx(j, src)
+        if self.attached_at[j] is None:
+            self.attached_at[j] = now
+        self.send(j, now, "SETUP_ACK", src)
+        if self.mode != "old":
+            self.trickle_reset(j, now)
+
+    def answers(self, j, stype):
+        if self.type[j] == GW:
+            return stype == SUB
+        if self.parent[j] is None:
+            return False
+        if self.type[j] == SUB:
+            return stype != SUB
+        return True
+
+    def receive(self, j, src, kind, stype, srank, now):
+        if kind == "SETUP" and self.answers(j, stype):
+            if self.mode == "old":
+                self.send(j, now, "RESPONSE", src)
+            else:
+                self.trickle_reset(j, now)
+        if kind == "RESPONSE":
+            if self.tr[j] is not None and stype == self.type[j]:
+                self.tr[j]["c"] += 1
+            if self.mode in ("jitter", "rank") and self.pending[j] is not None and self.outranks(stype, srank, j):
+                self.pending[j] = None
+            if self.can_parent(j, stype) and self.better(j, src, stype, srank):
+                self.attach(j, src, srank, now)
+
+    def outranks(self, stype, srank, j):
+        if self.mode == "rank":
+            return srank < self.rank[j]
+        return stype > self.type[j]
+
+    def start(self, i, now):
+        if self.mode == "old":
+            if self.type[i] == GW:
+                self.send(i, now, "SETUP")
+            else:
+                self.old_setup(i, now)
+            return
+        self.tr[i] = {"I": IMIN, "c": 0, "gen": 0}
+        self.trickle_interval(i, now)
+
+    def old_setup(self, i, now):
+        if self.parent[i] is None:
+            self.send(i, now, "SETUP")
+            self.at(now + 8.0, self.old_setup, i)
+
+    def trickle_interval(self, i, now):
+        tr = self.tr[i]
+        tr["c"] = 0
+        tr["gen"] += 1
+        t = tr["I"] / 2 + self.rng.uniform(0, tr["I"] / 2)
+        self.at(now + t, self.trickle_fire, i, tr["gen"])
+        self.at(now + tr["I"], self.trickle_end, i, tr["gen"])
+
+    def trickle_fire(self, i, gen, now):
+        tr = self.tr[i]
+        if gen != tr["gen"]:
+            return
+        if self.type[i] != GW and self.parent[i] is None:
+            self.send(i, now, "SETUP")
+        elif tr["c"] < K:
+            if self.mode in ("jitter", "rank"):
+                self.pending[i] = gen
+                base = 0 if self.type[i] != NODE or not STAGGER else JITTER / 2
+                span = JITTER / 2 if STAGGER else JITTER
+                self.at(now + base + self.rng.uniform(0, span), self.respond, i, gen)
+            else:
+                self.send(i, now, "RESPONSE")
+
+    def respond(self, i, gen, now):
+        if self.pending[i] == gen:
+            self.pending[i] = None
+            if self.tr[i]["c"] < K:
+                self.send(i, now, "RESPONSE")
+
+    def trickle_end(self, i, gen, now):
+        tr = self.tr[i]
+        if gen != tr["gen"]:
+            return
+        # SETUP of a node without a parent backs off to SETUP_IMAX only
+        imax = SETUP_IMAX if self.type[i] != GW and self.parent[i] is None else IMAX
+        tr["I"] = min(tr["I"] * 2, imax)
+        self.trickle_interval(i, now)
+
+    def trickle_reset(self, i, now):
+        tr = self.tr[i]
+        if tr is None or tr["I"] == IMIN:
+            return
+        tr["I"] = IMIN
+        self.trickle_interval(i, now)
+
+    def run(self, until):
+        reach = self.reachable()
+        done_at = None
+        while self.events:
+            t, _, f, a = heapq.heappop(self.events)
+            if t > until:
+                break
+            f(*a, t)
+            if done_at is None and all(self.attached_at[i] is not None for i in reach):
+                done_at = t
+                self.frames_at_done = sum(self.frames.values())
+        hops = []
+        self.path_etx = []
+        for i in reach:
+            if self.parent[i] is None or i == 0:
+                continue
+            h, k, c = 0, i, 0.0
+            while k != 0 and h < 100:
+                c += self.etx(k, self.parent[k]); k = self.parent[k]; h += 1
+            hops.append(h); self.path_etx.append(c)
+        return done_at, len(reach), hops
+
+AREA = float(os.environ.get('AREA', '100'))
+STAGGER = int(os.environ.get('STAGGER', '0'))
+LATE = float(os.environ.get('LATE', '0'))
+IMIN, IMAX, K, JITTER = 1.0, 128.0, 2, float(os.environ.get('JITTER', '0.125'))
+SETUP_IMAX = float(os.environ.get('SETUP_IMAX', '8'))
+
+if __name__ == "__main__":
+    mode = sys.argv[1]
+    n = int(sys.argv[2]) if len(sys.argv) > 2 else 50
+    runs = int(sys.argv[3]) if len(sys.argv) > 3 else 20
+    hour = 3600.0
+    times, frames, steady, colls, hopsum, etxsum, maxh, late = [], [], [], [], [], [], [], []
+    for seed in range(runs):
+        net = Net(n, seed, mode, float(sys.argv[4]) if len(sys.argv) > 4 else 1.0)
+        done, reach, hops = net.run(hour)
+        times.append(done if done is not None else float("inf"))
+        frames.append(getattr(net, "frames_at_done", float("nan")))
+        steady.append(sum(net.frames.values()))
+        colls.append(net.collisions)
+        hopsum.append(sum(hops) / len(hops))
+        etxsum.append(sum(net.path_etx) / len(net.path_etx))
+        maxh.append(max(hops))
+        if LATE:
+            late.append(net.attached_at[-1] - LATE if net.attached_at[-1] is not None else float("inf"))
+    times.sort()
+    fin = [t for t in times if t != float("inf")]
+    print(dict((k, v) for k, v in net.frames.items()))
+    print("mean path ETX %.2f  max hops %.1f" % (sum(etxsum) / len(etxsum), sum(maxh) / len(maxh)))
+    print("%s n=%d runs=%d converged %d/%d  median %.1f s  p90 %.1f s  frames to converge %.0f  frames in 1 h %.0f  collisions %.0f  mean hops %.2f" % (
+        mode, n, runs, len(fin), runs, times[len(times) // 2], times[int(len(times) * 0.9)],
+        sum(frames) / len(frames), sum(steady) / len(steady), sum(colls) / len(colls), sum(hopsum) / len(hopsum)))
+    if LATE:
+        late.sort()
+        print("late node joined %.1f s (median), %.1f s (max) after coming in range" % (late[len(late) // 2], late[-1]))
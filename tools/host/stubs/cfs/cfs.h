@@ -0,0 +1,11 @@
+#ifndef STUB_CFS_CFS_H
+#define STUB_CFS_CFS_H
+#define CFS_READ 1
+#define CFS_WRITE 2
+#define CFS_APPEND 4
+#define CFS_SEEK_SET 0
+typedef long cfs_offset_t;
+int cfs_open(const char *n, int f); void cfs_close(int fd);
+int cfs_read(int fd, void *b, unsigned int l); int cfs_write(int fd, const void *b, unsigned int l);
+cfs_offset_t cfs_seek(int fd, cfs_offset_t o, int w); int cfs_remove(const char *n);
+#endif
@@ -0,0 +1,59 @@
+#ifndef STUB_CONTIKI_H
+#define STUB_CONTIKI_H
+/* Just enough of the Contiki-NG API to build the routing on a host */
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+typedef unsigned long clock_time_t;
+#define CLOCK_SECOND 128UL
+clock_time_t clock_time(void);
+unsigned long clock_seconds(void);
+typedef unsigned char process_event_t;
+typedef void *process_data_t;
+struct pt { int lc; };
+struct process { const char *name; };
+#define PROCESS(name, str) struct process name
+#define PROCESS_NAME(name) extern struct process name
+#define AUTOSTART_PROCESSES(...) struct process *autostart_processes[] = {__VA_ARGS__, NULL}
+#define PROCESS_THREAD(name, ev, data) int process_thread_##name(struct pt *process_pt, process_event_t ev, process_data_t data)
+#define PROCESS_BEGIN() {
+#define PROCESS_END() } return 0
+#define PROCESS_YIELD()
+#define PROCESS_PAUSE()
+#define PROCESS_WAIT_EVENT()
+#define PROCESS_WAIT_EVENT_UNTIL(c) while(!(c)){}
+#define PROCESS_YIELD_UNTIL(c) while(!(c)){}
+#define PROCESS_EVENT_TIMER 0x88
+#define PROCESS_EVENT_POLL 0x82
+#define PROCESS_EVENT_CONTINUE 0x85
+void process_poll(struct process *p);
+int process_post(struct process *p, process_event_t ev, process_data_t data);
+process_event_t process_alloc_event(void);
+void process_start(struct process *p, process_data_t data);
+int process_is_running(struct process *p);
+struct etimer { clock_time_t t; };
+void etimer_set(struct etimer *et, clock_time_t interval);
+void etimer_reset(struct etimer *et);
+void etimer_reset_with_new_interval(struct etimer *et, clock_time_t interval);
+void etimer_restart(struct etimer *et);
+void etimer_stop(struct etimer *et);
+int etimer_expired(struct etimer *et);
+struct ctimer { clock_time_t t; };
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr);
+void ctimer_reset(struct ctimer *c);
+void ctimer_restart(struct ctimer *c);
+void ctimer_stop(struct ctimer *c);
+int ctimer_expired(struct ctimer *c);
+#define LINKADDR_SIZE 8
+typedef union { unsigned char u8[LINKADDR_SIZE]; uint16_t u16; } linkaddr_t;
+extern linkaddr_t linkaddr_node_addr;
+extern const linkaddr_t linkaddr_null;
+int linkaddr_cmp(const linkaddr_t *a, const linkaddr_t *b);
+void linkaddr_copy(linkaddr_t *a, const linkaddr_t *b);
+typedef unsigned short rtimer_clock_t;
+rtimer_clock_t rtimer_now(void);
+#define RTIMER_NOW() rtimer_now()
+#define RTIMER_SECOND 32768
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#endif
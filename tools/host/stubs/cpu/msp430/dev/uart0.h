@@ -0,0 +1,4 @@
+#ifndef STUB_CPU_MSP430_DEV_UART0_H
+#define STUB_CPU_MSP430_DEV_UART0_H
+void uart0_set_input(int (*f)(unsigned char));
+#endif
@@ -0,0 +1,7 @@
+#ifndef STUB_DEV_CC2420_H
+#define STUB_DEV_CC2420_H
+#include "contiki.h"
+extern signed char cc2420_last_rssi;
+extern uint8_t cc2420_last_correlation;
+#define CC2420_MAX_PACKET_LEN 127
+#endif
@@ -0,0 +1,7 @@
+#ifndef STUB_DEV_LEDS_H
+#define STUB_DEV_LEDS_H
+#define LEDS_RED 1
+#define LEDS_YELLOW 2
+#define LEDS_GREEN 4
+void leds_on(unsigned char l); void leds_off(unsigned char l);
+#endif
@@ -0,0 +1,6 @@
+#ifndef STUB_DEV_SERIAL_LINE_H
+#define STUB_DEV_SERIAL_LINE_H
+#include "contiki.h"
+extern process_event_t serial_line_event_message;
+void serial_line_init(void); int serial_line_input_byte(unsigned char c);
+#endif
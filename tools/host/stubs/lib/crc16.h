@@ -0,0 +1,5 @@
+#ifndef STUB_CRC16_H
+#define STUB_CRC16_H
+unsigned short crc16_add(unsigned char b, unsigned short crc);
+unsigned short crc16_data(const unsigned char *data, int datalen, unsigned short acc);
+#endif
@@ -0,0 +1,5 @@
+#ifndef STUB_LIB_RANDOM_H
+#define STUB_LIB_RANDOM_H
+unsigned short random_rand(void);
+#define RANDOM_RAND_MAX 65535U
+#endif
@@ -0,0 +1,7 @@
+#ifndef STUB_NET_NETSTACK_H
+#define STUB_NET_NETSTACK_H
+#include "contiki.h"
+struct network_driver { void (*output)(const linkaddr_t *); };
+extern const struct network_driver nullnet_driver;
+#define NETSTACK_NETWORK nullnet_driver
+#endif
@@ -0,0 +1,8 @@
+#ifndef STUB_NET_PACKETBUF_H
+#define STUB_NET_PACKETBUF_H
+#include "contiki.h"
+#define PACKETBUF_ADDR_SENDER 0
+#define PACKETBUF_ADDR_RECEIVER 1
+const linkaddr_t *packetbuf_addr(uint8_t type);
+extern linkaddr_t stub_mac_addrs[2];
+#endif
@@ -0,0 +1,71 @@
+/* Host side implementations of the stubbed Contiki-NG functions,
+   timers never fire and the radio output only counts frames */
+#include "contiki.h"
+#include "net/netstack.h"
+#include "net/nullnet/nullnet.h"
+#include "sys/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+linkaddr_t linkaddr_node_addr;
+const linkaddr_t linkaddr_null;
+int linkaddr_cmp(const linkaddr_t *a, const linkaddr_t *b) { return memcmp(a, b, LINKADDR_SIZE) == 0; }
+void linkaddr_copy(linkaddr_t *a, const linkaddr_t *b) { memcpy(a, b, LINKADDR_SIZE); }
+uint8_t *nullnet_buf; uint16_t nullnet_len;
+int stub_sent_frames; int stub_sent_bytes;
+void (*stub_output_hook)(const linkaddr_t *d);
+static void out(const linkaddr_t *d) { stub_sent_frames++; stub_sent_bytes += nullnet_len; if (stub_output_hook) stub_output_hook(d); }
+const struct network_driver nullnet_driver = { out };
+nullnet_input_callback stub_input; void nullnet_set_input_callback(nullnet_input_callback c) { stub_input = c; }
+signed char cc2420_last_rssi; uint8_t cc2420_last_correlation;
+clock_time_t stub_clock; clock_time_t clock_time(void) { return stub_clock; }
+unsigned long clock_seconds(void) { return stub_clock / CLOCK_SECOND; }
+void log_lladdr(const linkaddr_t *a) {}
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *p) {}
+void ctimer_stop(struct ctimer *c) {}
+void ctimer_reset(struct ctimer *c) {}
+void ctimer_restart(struct ctimer *c) {}
+int ctimer_expired(struct ctimer *c) { return 1; }
+void etimer_set(struct etimer *et, clock_time_t i) {}
+void etimer_reset(struct etimer *et) {}
+void etimer_stop(struct etimer *et) {}
+int etimer_expired(struct etimer *et) { return 1; }
+void process_poll(struct process *p) {}
+int process_post(struct process *p, process_event_t e, process_data_t d) { return 0; }
+void process_start(struct process *p, process_data_t d) {}
+unsigned short random_rand(void) { return rand() & 0xffff; }
+rtimer_clock_t rtimer_now(void) { return 0; }
+#include "net/packetbuf.h"
+linkaddr_t stub_mac_addrs[2];
+const linkaddr_t *packetbuf_addr(uint8_t type) { return &stub_mac_addrs[type]; }
+int process_is_running(struct process *p) { return 1; }
+
+/* In-memory CFS with a single file, enough for the checkpoint */
+#include "cfs/cfs.h"
+#include <string.h>
+static unsigned char cfs_file[4096];
+static int cfs_file_len = -1, cfs_pos;
+int cfs_open(const char *n, int f) {
+  if (f & CFS_WRITE) { cfs_file_len = 0; }
+  else if (cfs_file_len < 0) { return -1; }
+  cfs_pos = 0;
+  return 3;
+}
+void cfs_close(int fd) {}
+int cfs_read(int fd, void *b, unsigned int l) {
+  if (cfs_pos + (int)l > cfs_file_len) { l = cfs_file_len - cfs_pos; }
+  memcpy(b, cfs_file + cfs_pos, l); cfs_pos += l; return l;
+}
+int cfs_write(int fd, const void *b, unsigned int l) {
+  if (cfs_file_len + l > sizeof(cfs_file)) { return -1; }
+  memcpy(cfs_file + cfs_file_len, b, l); cfs_file_len += l; return l;
+}
+cfs_offset_t cfs_seek(int fd, cfs_offset_t o, int w) { cfs_pos = o; return o; }
+int cfs_remove(const char *n) { cfs_file_len = -1; return 0; }
+unsigned short crc16_add(unsigned char b, unsigned short acc) {
+  acc ^= b; acc = (acc >> 8) | (acc << 8); acc ^= (acc & 0xff00) << 4;
+  acc ^= (acc >> 8) >> 4; acc ^= (acc & 0xff00) >> 5; return acc;
+}
+unsigned short crc16_data(const unsigned char *d, int n, unsigned short acc) {
+  for (int i = 0; i < n; i++) { acc = crc16_add(d[i], acc); }
+  return acc;
+}
@@ -0,0 +1,21 @@
+#ifndef STUB_SYS_LOG_H
+#define STUB_SYS_LOG_H
+/* Logging is compiled out, the benchmarks time the send paths alone */
+#include <stdio.h>
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DBG 4
+void log_lladdr(const linkaddr_t *a);
+#define LOG_INFO(...)
+#define LOG_INFO_(...)
+#define LOG_WARN(...)
+#define LOG_WARN_(...)
+#define LOG_ERR(...)
+#define LOG_DBG(...)
+#define LOG_DBG_(...)
+#define LOG_INFO_LLADDR(a)
+#define LOG_WARN_LLADDR(a)
+#define LOG_DBG_LLADDR(a)
+#endif
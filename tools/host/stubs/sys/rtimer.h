@@ -0,0 +1 @@
+#include "contiki.h"